@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/resource.h>
+
+#include <btstack/btstack.h>
+#include <btstack/utils.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/linked_list.h>
+#include "bthid.h"
+#include "hiddevs.h"
+#include "uhid.h"
+#include "hcicmd.h"
+#include "capture.h"
+#include "standin.h"
+
+// benchmarks for tinyhidd, run against the BTstack stand-in in standin.c.
+// all times are virtual except CPU time. results are printed as one line of
+// key=value pairs per run, for diffing between releases.
+
+#define COD_MOUSE   0x002580
+#define DEFAULT_MTU 250     // as tinyhidd.c registers its services with
+
+// allocation counting {{{
+// every allocation in the process goes through here, including libc's own
+// (eg. fopen), so leaks and allocations on the connection path show up
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static uint64_t nallocs, nfrees;
+
+void *malloc(size_t size) {
+    void *p = __libc_malloc(size);
+    if (p)
+        nallocs++;
+    return p;
+}
+void *calloc(size_t n, size_t size) {
+    void *p = __libc_calloc(n, size);
+    if (p)
+        nallocs++;
+    return p;
+}
+void *realloc(void *p, size_t size) {
+    void *q = __libc_realloc(p, size);
+    if (!p && q)
+        nallocs++;
+    else if (p && !size)
+        nfrees++;
+    return q;
+}
+void free(void *p) {
+    if (p)
+        nfrees++;
+    __libc_free(p);
+}
+// }}}
+
+static int ndevs = 8;
+static int nready;
+// when each device last connected, whether it is ready yet and whether a
+// report has got through, and how long devices took to get there
+static uint64_t *connected_at;
+static uint8_t *ready, *started;
+static capture_hist_t ready_lat, first_lat;
+// tinyhidd's own output goes to /dev/null, results here
+static FILE *results;
+static char store[] = "/tmp/tinyhidd-bench.XXXXXX";
+
+static bthid_dev_t * find_dev(int n) {
+    bd_addr_t addr;
+    standin_addr(n, addr);
+    linked_list_iterator_t it;
+    linked_list_iterator_init(&it, &bthid_devs);
+    while (linked_list_iterator_has_next(&it)) {
+        bthid_dev_t *dev = (bthid_dev_t *)linked_list_iterator_next(&it);
+        if (!BD_ADDR_CMP(dev->addr, addr))
+            return dev;
+    }
+    return NULL;
+}
+
+// the kernel opens a device as soon as it is registered; do that for it. a
+// device is ready once it is registered with its full descriptor, and has
+// started once one of its reports has been passed on
+static void check_ready(int n) {
+    if (ready[n] && started[n])
+        return;
+    bthid_dev_t *dev = find_dev(n);
+    if (!dev || !dev->ds)
+        return;
+    if (!dev->uhid_open)
+        bthid_set_open(dev, 1);
+    if (!ready[n] && !dev->boot) {
+        ready[n] = 1;
+        nready++;
+        capture_hist_add(&ready_lat, (standin_now - connected_at[n]) * 1000);
+    }
+    if (!started[n] && dev->got_report) {
+        started[n] = 1;
+        capture_hist_add(&first_lat, (standin_now - connected_at[n]) * 1000);
+    }
+}
+
+// SDP queries run one at a time, so allow for all of them
+#define CONNECT_US(count)   (1000000 + (count) * 100000)
+
+// connect the first count devices at t
+static void connect_start(int count, uint64_t t) {
+    int i;
+    nready = 0;
+    for (i=0; i<count; i++) {
+        connected_at[i] = t;
+        ready[i] = started[i] = 0;
+        standin_connect(i, t, COD_MOUSE);
+    }
+}
+
+// connect the first count devices at t, and wait for them to be ready
+static int connect_all(int count, uint64_t t) {
+    connect_start(count, t);
+    standin_run(t + CONNECT_US(count));
+    return count - nready;
+}
+
+static long maxrss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static int live_devs(void) {
+    int n = 0;
+    linked_list_iterator_t it;
+    linked_list_iterator_init(&it, &bthid_devs);
+    while (linked_list_iterator_has_next(&it)) {
+        linked_list_iterator_next(&it);
+        n++;
+    }
+    return n;
+}
+
+// connect every device at once, let each send a few reports, and drop them
+// all again, cycles times. the first cycle warms up (stdio buffers, the
+// hiddevs cache); after that, anything allocated should be freed again
+static void churn(int cycles) {
+    static uint8_t report[] = { 0xA1, 0x00, 0x01, 0xFF };
+    uint64_t allocs = 0, live = 0;
+    int i, c, not_ready = 0;
+
+    for (c=0; c<cycles; c++) {
+        uint64_t allocs0 = nallocs;
+
+        not_ready += connect_all(ndevs, standin_now + 1000);
+
+        uint64_t t = standin_now;
+        for (i=0; i<ndevs; i++)
+            standin_stream(i, t, 1000, 10, report, sizeof(report));
+        t += 20000;
+        for (i=0; i<ndevs; i++)
+            standin_disconnect(i, t);
+        standin_run(t + 100000);
+
+        if (!c)
+            live = nallocs - nfrees;
+        else
+            allocs += nallocs - allocs0;
+    }
+
+    fprintf(results, "churn devices=%d cycles=%d not_ready=%d allocs_per_connect=%.2f "
+            "leaked_allocs=%lld live_devs=%d maxrss_kb=%ld\n",
+            ndevs, cycles, not_ready,
+            cycles > 1 ? (double)allocs / ((cycles - 1) * ndevs) : 0.0,
+            (long long)(nallocs - nfrees - live), live_devs(), maxrss_kb());
+}
+
+// link settings {{{
+// each device streams input reports and is sent output reports over the
+// modelled radio link, once for every setting of the hiddevs options. what
+// matters is how long reports take to get through and how many are lost
+#define LINK_SECONDS    10
+#define IN_PERIOD_US    8000    // 125Hz, as Bluetooth mice and tablets manage
+#define OUT_PERIOD_US   10000
+#define OUT_REPORTS     (LINK_SECONDS * 1000000 / OUT_PERIOD_US)
+#define OUT_LEN         8
+
+static int measuring;
+static capture_hist_t in_lat, out_lat;
+static uint64_t in_reports, in_bytes, in_lost[4], out_fate[4];
+static uint64_t *out_issued;
+static int report_len;
+
+static void report_done(int n, int out, uint64_t sent, uint8_t *data, int fate) {
+    if (!measuring)
+        return;
+    if (out) {
+        out_fate[fate]++;
+        if (fate == STANDIN_DELIVERED)
+            capture_hist_add(&out_lat, (standin_now - out_issued[n * OUT_REPORTS + READ_BT_16(data, 1)]) * 1000);
+        return;
+    }
+    if (fate != STANDIN_DELIVERED) {
+        in_lost[fate]++;
+        return;
+    }
+    in_reports++;
+    in_bytes += report_len - 1;
+    capture_hist_add(&in_lat, (standin_now - sent) * 1000);
+}
+
+// every device is stored with the same options
+static void write_store(const char *opts) {
+    FILE *f = fopen(store, "w");
+    int i;
+    for (i=0; i<ndevs; i++) {
+        bd_addr_t addr;
+        link_key_t key;
+        standin_addr(i, addr);
+        memset(key, i, sizeof(key));
+        fprintf(f, "%s ", bd_addr_to_str(addr));
+        fprintf(f, "%s %s\n", link_key_to_str(key), opts);
+    }
+    fclose(f);
+
+    // as tinyhidd does at startup
+    int mtu = hiddevs_max_mtu();
+    if (mtu < DEFAULT_MTU)
+        mtu = DEFAULT_MTU;
+    bt_send_cmd(&l2cap_register_service, PSM_HID_CONTROL, mtu);
+    bt_send_cmd(&l2cap_register_service, PSM_HID_INTERRUPT, mtu);
+}
+
+static void link_settings(const char *opts, int loss, int len) {
+    uint8_t *report = calloc(len, 1), out[OUT_LEN];
+    int i, k;
+
+    write_store(opts);
+    standin_radio = 1;
+    standin_loss_pct = loss;
+    report[0] = 0xA1;   // DATA | input
+    report_len = len;
+
+    int not_ready = connect_all(ndevs, standin_now + 1000);
+
+    measuring = 1;
+    memset(&in_lat, 0, sizeof(in_lat));
+    memset(&out_lat, 0, sizeof(out_lat));
+    in_reports = in_bytes = 0;
+    memset(in_lost, 0, sizeof(in_lost));
+    memset(out_fate, 0, sizeof(out_fate));
+
+    uint64_t t = standin_now;
+    for (i=0; i<ndevs; i++)
+        standin_stream(i, t, IN_PERIOD_US, LINK_SECONDS * 1000000 / IN_PERIOD_US, report, len);
+    memset(out, 0, sizeof(out));
+    for (k=0; k<OUT_REPORTS; k++) {
+        standin_run(t + (uint64_t)k * OUT_PERIOD_US);
+        bt_store_16(out, 0, k);
+        for (i=0; i<ndevs; i++) {
+            bthid_dev_t *dev = find_dev(i);
+            if (!dev)
+                continue;
+            out_issued[i * OUT_REPORTS + k] = standin_now;
+            bthid_report_out(dev, out, sizeof(out));
+        }
+    }
+    // let the last reports through
+    standin_run(t + LINK_SECONDS * 1000000 + 1000000);
+    measuring = 0;
+
+    uint64_t out_sent = (uint64_t)ndevs * OUT_REPORTS;
+    fprintf(results, "link options=\"%s\" devices=%d loss_pct=%d report_len=%d not_ready=%d "
+            "in_reports_per_s=%.1f in_kbit_per_s=%.1f in_too_long=%llu in_overrun=%llu "
+            "in_p50_us=%llu in_p99_us=%llu out_reports=%llu out_flushed=%llu out_replaced=%llu "
+            "out_p50_us=%llu out_p99_us=%llu\n",
+            opts, ndevs, loss, len, not_ready,
+            (double)in_reports / LINK_SECONDS / ndevs,
+            in_bytes * 8.0 / 1000 / LINK_SECONDS / ndevs,
+            (unsigned long long)in_lost[STANDIN_TOO_LONG], (unsigned long long)in_lost[STANDIN_OVERRUN],
+            (unsigned long long)capture_hist_percentile(&in_lat, 50) / 1000,
+            (unsigned long long)capture_hist_percentile(&in_lat, 99) / 1000,
+            (unsigned long long)out_sent, (unsigned long long)out_fate[STANDIN_FLUSHED],
+            (unsigned long long)(out_sent - out_fate[STANDIN_DELIVERED] - out_fate[STANDIN_FLUSHED]),
+            (unsigned long long)capture_hist_percentile(&out_lat, 50) / 1000,
+            (unsigned long long)capture_hist_percentile(&out_lat, 99) / 1000);
+
+    for (i=0; i<ndevs; i++)
+        standin_disconnect(i, standin_now + 1000);
+    standin_run(standin_now + 100000);
+    standin_radio = 0;
+    free(report);
+}
+// }}}
+
+// scale {{{
+// 1, 8, 64... devices at once, up to -n: how long they take to be ready when
+// they all connect together, what each costs in memory, and the CPU time per
+// report with every device sending at 1kHz. connecting and streaming is
+// repeated, so churn shows up in the allocations per connect
+#define SCALE_ROUNDS    5
+#define STREAM_PERIOD   1000
+#define STREAM_REPORTS  1000
+
+static uint64_t cpu_ns(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void scale(int count) {
+    static uint8_t report[] = { 0xA1, 0x00, 0x01, 0xFF };
+    uint64_t heap0, rss0, heap1, rss1, cpu = 0, allocs = 0, live = 0;
+    int i, r, not_ready = 0;
+
+    memset(&ready_lat, 0, sizeof(ready_lat));
+    for (r=0; r<SCALE_ROUNDS; r++) {
+        uint64_t allocs0 = nallocs;
+
+        if (!r)
+            capture_mem_usage(&heap0, &rss0);
+        not_ready += connect_all(count, standin_now + 1000);
+        if (!r)
+            capture_mem_usage(&heap1, &rss1);
+
+        uint64_t t = standin_now, cpu0 = cpu_ns();
+        for (i=0; i<count; i++)
+            standin_stream(i, t, STREAM_PERIOD, STREAM_REPORTS, report, sizeof(report));
+        standin_run(t + (uint64_t)STREAM_PERIOD * STREAM_REPORTS);
+        cpu += cpu_ns() - cpu0;
+
+        for (i=0; i<count; i++)
+            standin_disconnect(i, standin_now + 1000);
+        standin_run(standin_now + 100000);
+
+        if (!r)
+            live = nallocs - nfrees;
+        else
+            allocs += nallocs - allocs0;
+    }
+
+    // CPU time includes the stand-in's own, so it is an upper bound
+    fprintf(results, "scale devices=%d not_ready=%d ready_p50_ms=%.1f ready_p99_ms=%.1f "
+            "ready_max_ms=%.1f cpu_ns_per_report=%.0f heap_bytes_per_dev=%lld "
+            "rss_bytes_per_dev=%lld allocs_per_connect=%.2f leaked_allocs=%lld\n",
+            count, not_ready,
+            capture_hist_percentile(&ready_lat, 50) / 1e6,
+            capture_hist_percentile(&ready_lat, 99) / 1e6,
+            ready_lat.max / 1e6,
+            (double)cpu / ((uint64_t)SCALE_ROUNDS * count * STREAM_REPORTS),
+            (long long)(heap1 - heap0) / count, (long long)(rss1 - rss0) / count,
+            (double)allocs / ((SCALE_ROUNDS - 1) * count),
+            (long long)(nallocs - nfrees - live));
+}
+// }}}
+
+// boot protocol {{{
+// every device connects at once, with the user already moving the mouse,
+// once without -b and once with it: how long until the first report is
+// passed on
+#define MOVE_PERIOD_US  10000
+
+static void boot(int boot_protocol) {
+    // boot reports carry the boot descriptor's ID
+    static uint8_t report[] = { 0xA1, 0x00, 0x01, 0xFF };
+    static uint8_t boot_report[] = { 0xA1, 0x02, 0x00, 0x01, 0xFF };
+    int i, not_started = 0;
+
+    bthid_boot_protocol = boot_protocol;
+    memset(&ready_lat, 0, sizeof(ready_lat));
+    memset(&first_lat, 0, sizeof(first_lat));
+
+    uint64_t t = standin_now + 1000;
+    connect_start(ndevs, t);
+    for (i=0; i<ndevs; i++) {
+        if (boot_protocol)
+            standin_stream(i, t, MOVE_PERIOD_US, CONNECT_US(ndevs) / MOVE_PERIOD_US,
+                           boot_report, sizeof(boot_report));
+        else
+            standin_stream(i, t, MOVE_PERIOD_US, CONNECT_US(ndevs) / MOVE_PERIOD_US,
+                           report, sizeof(report));
+    }
+    standin_run(t + CONNECT_US(ndevs));
+    for (i=0; i<ndevs; i++)
+        not_started += !started[i];
+
+    fprintf(results, "boot boot_protocol=%d devices=%d not_ready=%d not_started=%d "
+            "first_report_p50_ms=%.1f first_report_p99_ms=%.1f first_report_max_ms=%.1f "
+            "ready_p50_ms=%.1f ready_p99_ms=%.1f\n",
+            boot_protocol, ndevs, ndevs - nready, not_started,
+            capture_hist_percentile(&first_lat, 50) / 1e6,
+            capture_hist_percentile(&first_lat, 99) / 1e6,
+            first_lat.max / 1e6,
+            capture_hist_percentile(&ready_lat, 50) / 1e6,
+            capture_hist_percentile(&ready_lat, 99) / 1e6);
+
+    for (i=0; i<ndevs; i++)
+        standin_disconnect(i, standin_now + 1000);
+    standin_run(standin_now + 100000);
+    bthid_boot_protocol = 0;
+}
+// }}}
+
+// the tests named after the options, or all of them if none are
+static int wanted(int argc, char **argv, const char *test) {
+    int i;
+    for (i=optind; i<argc; i++)
+        if (!strcmp(argv[i], test))
+            return 1;
+    return optind == argc;
+}
+
+void usage(void) {
+    printf("Usage: tinyhidd-bench [-n devices] [-c cycles] [-o options]... [-l loss] [-s len] [test]...\n"
+           "\n"
+           "    -n  number of virtual devices (default 8)\n"
+           "    -c  connect/disconnect cycles for churn (default 1000)\n"
+           "    -o  hiddevs options to measure link with, eg. \"class=tablet\"\n"
+           "        (default none, class=tablet, flush=5 and flush=20)\n"
+           "    -l  percentage of radio packets lost, for link (default 10)\n"
+           "    -s  input report length, for link (default 8 and 300)\n"
+           "\n"
+           "Tests are churn, link, scale and boot; by default, all of them.\n"
+          );
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    static const char *default_opts[] = { "", "class=tablet", "flush=5", "flush=20" };
+    const char *opts[8];
+    int cycles = 1000, nopts = 0, loss = 10, len = 0, i, c;
+
+    while ((c = getopt(argc, argv, "n:c:o:l:s:")) != -1) {
+        switch (c) {
+            case 'n':
+                ndevs = atoi(optarg);
+                if (ndevs < 1 || ndevs > 0xEFF)
+                    usage();
+                break;
+            case 'c':
+                cycles = atoi(optarg);
+                if (cycles < 1)
+                    usage();
+                break;
+            case 'o':
+                if (nopts == sizeof(opts)/sizeof(opts[0]))
+                    usage();
+                opts[nopts++] = optarg;
+                break;
+            case 'l':
+                loss = atoi(optarg);
+                if (loss < 0 || loss > 90)
+                    usage();
+                break;
+            case 's':
+                len = atoi(optarg);
+                if (len < 2 || len > 4097)
+                    usage();
+                break;
+            default:
+                usage();
+        }
+    }
+    for (i=optind; i<argc; i++)
+        if (strcmp(argv[i], "churn") && strcmp(argv[i], "link") && strcmp(argv[i], "scale") &&
+            strcmp(argv[i], "boot"))
+            usage();
+    if (!nopts) {
+        memcpy(opts, default_opts, sizeof(default_opts));
+        nopts = sizeof(default_opts)/sizeof(default_opts[0]);
+    }
+
+    results = fdopen(dup(1), "w");
+    if (!results || !freopen("/dev/null", "w", stdout))
+        return 1;
+
+    // the virtual devices are all paired, in a store of their own
+    int fd = mkstemp(store);
+    if (fd < 0)
+        return 1;
+    close(fd);
+    hiddevs_db_file = store;
+    uhid_path = "/dev/null";
+
+    remap_load();
+    standin_init(ndevs);
+    bt_register_packet_handler(bthid_packet_handler);
+    hcicmd_register_failure_handler(bthid_command_failed);
+    standin_event_hook = check_ready;
+    standin_report_hook = report_done;
+    out_issued = calloc((size_t)ndevs * OUT_REPORTS, sizeof(uint64_t));
+    connected_at = calloc(ndevs, sizeof(uint64_t));
+    ready = calloc(ndevs, 1);
+    started = calloc(ndevs, 1);
+
+    if (wanted(argc, argv, "churn")) {
+        write_store("");
+        churn(cycles);
+    }
+    if (wanted(argc, argv, "link")) {
+        for (i=0; i<nopts; i++) {
+            if (len) {
+                link_settings(opts[i], loss, len);
+            } else {
+                link_settings(opts[i], loss, 8);
+                link_settings(opts[i], loss, 300);
+            }
+        }
+    }
+    if (wanted(argc, argv, "scale")) {
+        write_store("");
+        for (i=1; i<ndevs; i*=8)
+            scale(i);
+        scale(ndevs);
+    }
+    if (wanted(argc, argv, "boot")) {
+        write_store("");
+        boot(0);
+        boot(1);
+    }
+    unlink(store);
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <btstack/btstack.h>
 #include <btstack/utils.h>
@@ -8,6 +9,10 @@
 #include <btstack/sdp_util.h>
 #include "bthid.h"
 #include "hiddevs.h"
+#include "capture.h"
+#include "uhid.h"
+#include "linkstats.h"
+#include "hcicmd.h"
 
 // utility functions (would be good in sdp_util) {{{
 static unsigned int de_get_uint(uint8_t *de) {
@@ -44,7 +49,7 @@ static bthid_dev_t * finddev_addr(bd_addr_t addr) {
     }
     return NULL;
 }
-static bthid_dev_t * finddev_handle(uint16_t handle) {
+bthid_dev_t * bthid_dev_for_handle(uint16_t handle) {
     linked_list_iterator_t it;
     linked_list_iterator_init(&it, &bthid_devs);
     while (linked_list_iterator_has_next(&it)) {
@@ -54,29 +59,145 @@ static bthid_dev_t * finddev_handle(uint16_t handle) {
     }
     return NULL;
 }
+// every data packet looks up its device by CID, so cache the answers.
+// BTstack hands out CIDs sequentially, so they spread well over the slots
+#ifdef BTHID_STATIC
+#define CID_CACHE_SIZE (BTHID_MAX_DEVS * 4)
+#else
+#define CID_CACHE_SIZE 1024
+#endif
+static bthid_dev_t *cid_cache[CID_CACHE_SIZE];
+
 static bthid_dev_t * finddev_cid(uint16_t cid) {
+    bthid_dev_t *dev = cid_cache[cid % CID_CACHE_SIZE];
+    if (dev && (dev->cid_interrupt == cid || dev->cid_control == cid))
+        return dev;
+
     linked_list_iterator_t it;
     linked_list_iterator_init(&it, &bthid_devs);
     while (linked_list_iterator_has_next(&it)) {
-        bthid_dev_t *dev = (bthid_dev_t *)linked_list_iterator_next(&it);
-        if (dev->cid_interrupt == cid || dev->cid_control == cid)
+        dev = (bthid_dev_t *)linked_list_iterator_next(&it);
+        if (dev->cid_interrupt == cid || dev->cid_control == cid) {
+            cid_cache[cid % CID_CACHE_SIZE] = dev;
             return dev;
+        }
     }
     return NULL;
 }
+
+// the one device with an SDP query in flight. BTstack only runs one at a
+// time; other devices wait their turn
+static bthid_dev_t *sdp_query_dev = NULL;
+static int sdp_busy = 0;
+#ifdef BTHID_STATIC
+static bthid_dev_t dev_pool[BTHID_MAX_DEVS];
+static uint8_t dev_pool_used[BTHID_MAX_DEVS];
+
+static bthid_dev_t * allocdev(void) {
+    int i;
+    for (i=0; i<BTHID_MAX_DEVS; i++) {
+        if (!dev_pool_used[i]) {
+            dev_pool_used[i] = 1;
+            return &dev_pool[i];
+        }
+    }
+    return NULL;
+}
+static void freedev(bthid_dev_t *dev) {
+    dev_pool_used[dev - dev_pool] = 0;
+}
+#else
+static bthid_dev_t * allocdev(void) {
+    return malloc(sizeof(bthid_dev_t));
+}
+static void freedev(bthid_dev_t *dev) {
+    if (dev->descriptor)
+        free(dev->descriptor);
+    if (dev->name)
+        free(dev->name);
+    if (dev->remap)
+        free(dev->remap);
+    free(dev);
+}
+#endif
+
+uint32_t bthid_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// returns NULL if we're out of device slots
 static bthid_dev_t * newdev(bd_addr_t addr, uint16_t handle) {
-    bthid_dev_t *dev = malloc(sizeof(bthid_dev_t));
+    bthid_dev_t *dev = allocdev();
+    if (!dev) {
+        printf("WARNING: no free device slots, ignoring %s\n", bd_addr_to_str(addr));
+        return NULL;
+    }
     memset(dev, 0, sizeof(bthid_dev_t));
     BD_ADDR_COPY(dev->addr, addr);
     dev->handle = handle;
+    dev->connect_ms = bthid_now_ms();
     linked_list_add(&bthid_devs, (linked_item_t *)dev);
     return dev;
 }
 static void deletedev(bthid_dev_t *dev) {
+    int i;
+    for (i=0; i<CID_CACHE_SIZE; i++)
+        if (cid_cache[i] == dev)
+            cid_cache[i] = NULL;
+    // its query still has to complete before the next can start
+    if (sdp_query_dev == dev)
+        sdp_query_dev = NULL;
+    if (dev->handshakes)
+        run_loop_remove_timer(&dev->boot_timer);
     linked_list_remove(&bthid_devs, (linked_item_t *)dev);
+    freedev(dev);
+}
+
+// descriptor and name storage; inline in the static build.
+// returns nonzero if the descriptor doesn't fit
+static int dev_set_descriptor(bthid_dev_t *dev, uint8_t *desc, int len) {
+#ifdef BTHID_STATIC
+    // a truncated descriptor would be misparsed, so don't take it at all
+    if (len > BTHID_MAX_DESCRIPTOR_LEN) {
+        printf("WARNING: HID descriptor of %s too long (%d bytes)\n", bd_addr_to_str(dev->addr), len);
+        return 1;
+    }
+    dev->descriptor = dev->descriptor_buf;
+#else
     if (dev->descriptor)
         free(dev->descriptor);
-    free(dev);
+    dev->descriptor = malloc(len);
+#endif
+    memcpy(dev->descriptor, desc, len);
+    dev->descriptor_len = len;
+    dev->report_ids = remap_has_ids(desc, len);
+    return 0;
+}
+static void dev_set_name(bthid_dev_t *dev, uint8_t *name) {
+    int len = strnlen((char *)name, BTHID_MAX_NAME_LEN);
+#ifdef BTHID_STATIC
+    dev->name = dev->name_buf;
+#else
+    if (dev->name)
+        free(dev->name);
+    dev->name = malloc(len + 1);
+#endif
+    memcpy(dev->name, name, len);
+    dev->name[len] = '\0';
+}
+static void dev_compile_remap(bthid_dev_t *dev) {
+#ifdef BTHID_STATIC
+    dev->remap = remap_compile(dev->addr, dev->descriptor, dev->descriptor_len, &dev->remap_buf);
+#else
+    if (dev->remap)
+        free(dev->remap);
+    remap_t *buf = malloc(sizeof(remap_t));
+    dev->remap = remap_compile(dev->addr, dev->descriptor, dev->descriptor_len, buf);
+    if (!dev->remap)
+        free(buf);
+#endif
 }
 bthid_dev_t * bthid_dev_for_ds(data_source_t *ds) {
     linked_list_iterator_t it;
@@ -92,41 +213,263 @@ bthid_dev_t * bthid_dev_for_ds(data_source_t *ds) {
 
 // queueing and running outgoing connection attempts {{{
 
-// called to start connecting, and on L2CAP connection result from outgoing conn
-static void outgoing_l2cap_open(bthid_dev_t *dev, int status) {
-    if (status) {   // give up - XXX close any conns
-        if (dev->outgoing_retries++ > 5) {
-            printf("Unable to connect to %s\n", bd_addr_to_str(dev->addr));
-            deletedev(dev);
-        }
-        return;
+static void create_channel(bthid_dev_t *dev, uint16_t psm) {
+    hiddevs_link_t link;
+    if (hiddevs_read_link(dev->addr, &link) && link.mtu)
+        bt_send_cmd(&l2cap_create_channel_mtu, dev->addr, psm, link.mtu);
+    else
+        bt_send_cmd(&l2cap_create_channel, dev->addr, psm);
+}
+
+#define OUTGOING_RETRIES    5
+
+// called to start connecting, and on L2CAP connection result from outgoing conn.
+// a failed channel is asked for again, up to OUTGOING_RETRIES times. pairing
+// gives up at once: retrying won't fix a wrong PIN, and until it's paired
+// the device mustn't be let in. returns nonzero if it gave up and dev is gone
+static int outgoing_l2cap_open(bthid_dev_t *dev, int status) {
+    if (status && (dev->pairing || dev->outgoing_retries++ >= OUTGOING_RETRIES)) {
+        if (dev->pairing)
+            printf("Failed to pair with %s (status 0x%02X). Check the PIN - many devices use 0000 or 1234\n",
+                   bd_addr_to_str(dev->addr), status);
+        else
+            printf("Unable to connect to %s (status 0x%02X)\n", bd_addr_to_str(dev->addr), status);
+        if (dev->cid_interrupt)
+            bt_send_cmd(&l2cap_disconnect, dev->cid_interrupt, 0);
+        if (dev->cid_control)
+            bt_send_cmd(&l2cap_disconnect, dev->cid_control, 0);
+        uhid_unregister(dev);
+        deletedev(dev);
+        return 1;
     }
 
     if (!dev->cid_interrupt) {
-        bt_send_cmd(&l2cap_create_channel, dev->addr, PSM_HID_INTERRUPT);
-        return;
+        create_channel(dev, PSM_HID_INTERRUPT);
+        return 0;
     }
     if (!dev->cid_control) {
-        bt_send_cmd(&l2cap_create_channel, dev->addr, PSM_HID_CONTROL);
-        return;
+        create_channel(dev, PSM_HID_CONTROL);
+        return 0;
     }
 
     if (dev->cid_control && dev->cid_interrupt)
         dev->outgoing = 0;  // we're done
+    return 0;
 }
 static void queue_outgoing_conn(bd_addr_t addr) {
     bthid_dev_t *dev = finddev_addr(addr);
-    if (dev)
+    if (dev && !dev->adopted)
+        return;
+    if (!dev)
+        dev = newdev(addr, 0);
+    if (!dev)
         return;
-    dev = newdev(addr, 0);
     dev->outgoing = 1;
+    dev->adopted = 0;
     printf("Attempting connection to %s\n", bd_addr_to_str(dev->addr));
     outgoing_l2cap_open(dev, 0);
 }
 // }}}
 
+// pairing requested over the control socket {{{
+
+// connect out as for a known device. BTstack asks for a link key, which we
+// refuse, then a PIN; the new link key is stored and the connection carries
+// straight on to SDP and uhid like any other
+void bthid_pair(bd_addr_t addr, const char *pin) {
+    if (finddev_addr(addr)) {
+        printf("%s is already connected\n", bd_addr_to_str(addr));
+        return;
+    }
+    printf("Pairing with %s\n", bd_addr_to_str(addr));
+    hiddevs_remove(addr);
+    bthid_dev_t *dev = newdev(addr, 0);
+    if (!dev)
+        return;
+    dev->pairing = 1;
+    strncpy(dev->pin, pin, sizeof(dev->pin) - 1);
+    dev->outgoing = 1;
+    outgoing_l2cap_open(dev, 0);
+}
+
+// a stored device, or one we're in the middle of pairing
+static int known_dev(bd_addr_t addr) {
+    if (hiddevs_is_hid(addr))
+        return 1;
+    bthid_dev_t *dev = finddev_addr(addr);
+    return dev && dev->pairing;
+}
+// }}}
+
+// boot protocol startup {{{
+int bthid_boot_protocol = 0;
+
+// HID spec appendix B boot descriptors, with report IDs added so that boot
+// reports (which always carry an ID) can be passed through as they are
+static uint8_t boot_keyboard_desc[] = {
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x85, 0x01,
+    0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+    0x75, 0x01, 0x95, 0x08, 0x81, 0x02,                 // modifiers
+    0x95, 0x01, 0x75, 0x08, 0x81, 0x01,                 // reserved
+    0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05,
+    0x91, 0x02,                                         // LEDs
+    0x95, 0x01, 0x75, 0x03, 0x91, 0x01,
+    0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65,
+    0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00,     // keys
+    0xC0,
+};
+static uint8_t boot_mouse_desc[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x02,
+    0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+    0x95, 0x03, 0x75, 0x01, 0x81, 0x02,                 // buttons
+    0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7F,
+    0x75, 0x08, 0x95, 0x02, 0x81, 0x06,                 // X, Y
+    0xC0, 0xC0,
+};
+
+#define COD_MAJOR(cod)      (((cod) >> 8) & 0x1f)
+#define COD_PERIPHERAL      0x05
+#define COD_KEYBOARD        0x40
+#define COD_POINTING        0x80
+
+#define HID_HANDSHAKE       0x00
+#define HID_SET_PROTOCOL    0x70
+#define HID_PROTOCOL_BOOT   0
+#define HID_PROTOCOL_REPORT 1
+
+// how long a device gets to answer SET_PROTOCOL
+#define BOOT_TIMEOUT_MS     1000
+
+static void boot_timeout(timer_source_t *ts);
+
+static void set_protocol(bthid_dev_t *dev, int protocol) {
+    uint8_t cmd = HID_SET_PROTOCOL | protocol;
+    bt_send_l2cap(dev->cid_control, &cmd, 1);
+
+    if (dev->handshakes++)
+        run_loop_remove_timer(&dev->boot_timer);
+    dev->boot_timer.process = boot_timeout;
+    run_loop_set_timer(&dev->boot_timer, BOOT_TIMEOUT_MS);
+    run_loop_add_timer(&dev->boot_timer);
+}
+
+static void enter_boot(bthid_dev_t *dev) {
+    dev->boot = BOOT_ENTERING;
+    set_protocol(dev, HID_PROTOCOL_BOOT);
+}
+
+// once both channels are up, keyboards and mice can be used right away
+static void start_boot(bthid_dev_t *dev) {
+    uint8_t desc[sizeof(boot_keyboard_desc) + sizeof(boot_mouse_desc)];
+    int len = 0;
+
+    // reconnected after a restart, still registered with the boot descriptor.
+    // if the full descriptor is known, it's about to be switched over anyway
+    if (dev->boot == BOOT_ACTIVE) {
+        if (!dev->descriptor)
+            enter_boot(dev);
+        return;
+    }
+
+    // we only learn the class of devices that connect to us; for the rest,
+    // the store may say
+    hiddevs_link_t link;
+    if (!dev->cod && hiddevs_read_link(dev->addr, &link))
+        dev->cod = link.cod;
+
+    if (!bthid_boot_protocol || dev->ds || COD_MAJOR(dev->cod) != COD_PERIPHERAL)
+        return;
+
+    if (dev->cod & COD_KEYBOARD) {
+        memcpy(desc + len, boot_keyboard_desc, sizeof(boot_keyboard_desc));
+        len += sizeof(boot_keyboard_desc);
+    }
+    if (dev->cod & COD_POINTING) {
+        memcpy(desc + len, boot_mouse_desc, sizeof(boot_mouse_desc));
+        len += sizeof(boot_mouse_desc);
+    }
+    if (!len)
+        return;
+
+    printf("Starting %s in boot protocol\n", bd_addr_to_str(dev->addr));
+    uhid_register_boot(dev, desc, len);
+    if (dev->ds)
+        enter_boot(dev);
+}
+
+// the full descriptor is known: go to report protocol. input is dropped
+// until the device acknowledges, then the uhid device is swapped over
+static void end_boot(bthid_dev_t *dev) {
+    dev->boot = BOOT_SWITCHING;
+    set_protocol(dev, HID_PROTOCOL_REPORT);
+}
+
+// the outcome of the last SET_PROTOCOL; ok is 0 if it was refused or
+// never answered
+static void boot_result(bthid_dev_t *dev, int ok) {
+    if (dev->boot == BOOT_ENTERING) {
+        if (ok) {
+            dev->boot = BOOT_ACTIVE;
+            return;
+        }
+        // its reports won't fit the boot descriptor. it can wait for the
+        // full one like any other device
+        printf("WARNING: %s not in boot protocol, waiting for its descriptor\n", bd_addr_to_str(dev->addr));
+        dev->boot = BOOT_NONE;
+        uhid_unregister(dev);
+        return;
+    }
+    if (dev->boot == BOOT_SWITCHING) {
+        // nothing better to do than assume report protocol, its default
+        if (!ok)
+            printf("WARNING: %s did not confirm report protocol\n", bd_addr_to_str(dev->addr));
+        dev->boot = BOOT_NONE;
+        uhid_recreate(dev);
+    }
+}
+
+// HANDSHAKEs come back in the order the requests went out, so with two
+// outstanding, the first answers a boot request that has been superseded
+static void boot_handshake(bthid_dev_t *dev, uint8_t result) {
+    if (!dev->handshakes || --dev->handshakes)
+        return;
+    run_loop_remove_timer(&dev->boot_timer);
+    if (result)
+        printf("WARNING: %s refused SET_PROTOCOL (0x%X)\n", bd_addr_to_str(dev->addr), result);
+    boot_result(dev, !result);
+}
+
+static void boot_timeout(timer_source_t *ts) {
+    bthid_dev_t *dev = NULL;
+    linked_list_iterator_t it;
+    linked_list_iterator_init(&it, &bthid_devs);
+    while (linked_list_iterator_has_next(&it)) {
+        dev = (bthid_dev_t *)linked_list_iterator_next(&it);
+        if (&dev->boot_timer == ts)
+            break;
+        dev = NULL;
+    }
+    if (!dev)
+        return;
+    printf("WARNING: %s did not answer SET_PROTOCOL\n", bd_addr_to_str(dev->addr));
+    dev->handshakes = 0;
+    boot_result(dev, 0);
+}
+// }}}
+
 // pump and handle SDP attributes like descriptor and IDs {{{
 
+// a device we can't serve: drop it and its link
+static void refuse_dev(bthid_dev_t *dev) {
+    printf("Refusing %s\n", bd_addr_to_str(dev->addr));
+    if (dev->handle)
+        hcicmd_send(HCICMD_NORMAL, &hci_disconnect, dev->handle, 0x13);
+    uhid_unregister(dev);
+    deletedev(dev);
+}
+
 static void read_hid_descriptor(bthid_dev_t *dev, uint8_t *de, int size) {
     // HID report descs: DES { DES[] { UINT class, STRING descr } }
     // remove outer wrap:
@@ -159,18 +502,13 @@ static void read_hid_descriptor(bthid_dev_t *dev, uint8_t *de, int size) {
             continue;
         }
 
-        if (dev->descriptor)
-            free(dev->descriptor);
-
-        dev->descriptor = malloc(hiddesc_size);
-        memcpy(dev->descriptor, hiddesc, hiddesc_size);
-        dev->descriptor_len = hiddesc_size;
+        if (dev_set_descriptor(dev, hiddesc, hiddesc_size))
+            refuse_dev(dev);
         return;
     }
     printf("No HID report descriptors found.\n");
 }
 
-static bthid_dev_t *sdp_query_dev = NULL;
 static void sdp_packet_handler(uint8_t *packet, int size) {
     if (!sdp_query_dev) // no active query! what XXX error
         return;
@@ -198,8 +536,13 @@ static void sdp_packet_handler(uint8_t *packet, int size) {
 }
 
 static void sdp_query_attributes(bthid_dev_t *dev, uint16_t uuid, uint16_t first, uint16_t last) {
-    if (sdp_query_dev)
+    static unsigned int wait_seq = 0;
+    if (sdp_busy) {
+        if (!dev->sdp_waiting)
+            dev->sdp_waiting = ++wait_seq;
         return;
+    }
+    sdp_busy = 1;
     sdp_query_dev = dev;
     uint8_t ids[10], atts[20];
     de_create_sequence(ids);
@@ -210,10 +553,63 @@ static void sdp_query_attributes(bthid_dev_t *dev, uint16_t uuid, uint16_t first
 
 }
 
+static void pump_attributes(bthid_dev_t *dev);
+
+// let waiting devices continue, oldest first, until one starts a query
+static void sdp_next(void) {
+    while (!sdp_busy) {
+        bthid_dev_t *next = NULL;
+        linked_list_iterator_t it;
+        linked_list_iterator_init(&it, &bthid_devs);
+        while (linked_list_iterator_has_next(&it)) {
+            bthid_dev_t *dev = (bthid_dev_t *)linked_list_iterator_next(&it);
+            if (dev->sdp_waiting &&
+                (!next || (int)(dev->sdp_waiting - next->sdp_waiting) < 0))
+                next = dev;
+        }
+        if (!next)
+            return;
+        next->sdp_waiting = 0;
+        pump_attributes(next);
+    }
+}
+
+// the name is only for show, so after a retry make one up rather than
+// leave the device waiting for it
+#define NAME_RETRIES 1
+
+static void name_failed(bthid_dev_t *dev) {
+    if (!dev->name_pending)
+        return;
+    dev->name_pending = 0;
+    if (dev->name_failures++ >= NAME_RETRIES) {
+        // dev_set_name reads up to the full length
+        char name[BTHID_MAX_NAME_LEN + 1];
+        printf("WARNING: couldn't get the name of %s\n", bd_addr_to_str(dev->addr));
+        snprintf(name, sizeof(name), "Bluetooth HID %s", bd_addr_to_str(dev->addr));
+        dev_set_name(dev, (uint8_t *)name);
+    }
+    pump_attributes(dev);
+}
+
+static void link_mode_failed(uint16_t opcode, uint16_t handle);
+
+void bthid_command_failed(uint16_t opcode, uint8_t *params) {
+    bd_addr_t addr;
+    link_mode_failed(opcode, READ_BT_16(params, 0));
+    if (opcode != hci_remote_name_request.opcode)
+        return;
+    bt_flip_addr(addr, params);
+    bthid_dev_t *dev = finddev_addr(addr);
+    if (dev && !dev->name)
+        name_failed(dev);
+}
+
 // while not all desired attributes are known, send more requests -- one at a time
 static void pump_attributes(bthid_dev_t *dev) {
     if (!dev->name) {
-        bt_send_cmd(&hci_remote_name_request, &dev->addr, 2, 0, 0);
+        dev->name_pending = 1;
+        hcicmd_send(HCICMD_BACKGROUND, &hci_remote_name_request, &dev->addr, 2, 0, 0);
         return;
     }
     if (!dev->descriptor) {
@@ -227,15 +623,225 @@ static void pump_attributes(bthid_dev_t *dev) {
 
     // we have everything to begin, stop pumping and run
     printf("HID device active\n");
+    capture_device(dev);
+    dev_compile_remap(dev);
+    if (dev->boot)
+        end_boot(dev);
+    else if (!dev->ds)  // unless taken over from before a restart
+        uhid_register(dev);
+}
+
+bthid_dev_t * bthid_replay_dev(bd_addr_t addr, uint16_t cid_base, uint8_t *name,
+        uint16_t vendor_id, uint16_t product_id, uint16_t version,
+        uint8_t *descriptor, int descriptor_len) {
+    bthid_dev_t *dev = newdev(addr, 0);
+    if (!dev)
+        return NULL;
+    dev->cid_interrupt = cid_base;
+    dev->cid_control = cid_base + 1;
+    dev_set_name(dev, name);
+    if (dev_set_descriptor(dev, descriptor, descriptor_len)) {
+        deletedev(dev);
+        return NULL;
+    }
+    dev->vendor_id = vendor_id;
+    dev->product_id = product_id;
+    dev->version = version;
+    dev_compile_remap(dev);
     uhid_register(dev);
+    // there's no reader to tell us otherwise
+    dev->uhid_open = 1;
+    return dev;
+}
+
+// a device handed over by the previous process on restart, whose uhid
+// device is still open on fd. the Bluetooth side reconnects once BTstack
+// is up, with the attributes already known
+bthid_dev_t * bthid_adopt_dev(bd_addr_t addr, uint8_t *name,
+        uint16_t vendor_id, uint16_t product_id, uint16_t version,
+        uint32_t cod, int boot, int open, uint8_t *descriptor, int descriptor_len, int fd) {
+    bthid_dev_t *dev = newdev(addr, 0);
+    if (!dev)
+        return NULL;
+    dev->adopted = 1;
+    if (name)
+        dev_set_name(dev, name);
+    if (descriptor_len && dev_set_descriptor(dev, descriptor, descriptor_len)) {
+        deletedev(dev);
+        return NULL;
+    }
+    dev->vendor_id = vendor_id;
+    dev->product_id = product_id;
+    dev->version = version;
+    dev->cod = cod;
+    dev->boot = boot ? BOOT_ACTIVE : BOOT_NONE;
+    if (!dev->boot && dev->descriptor)
+        dev_compile_remap(dev);
+    dev->uhid_started = 1;
+    dev->uhid_open = open;
+    uhid_adopt(dev, fd);
+    return dev;
 }
 // }}}
 
+// output queue {{{
+// BTstack grants each channel a credit when there is ACL buffer space for
+// it, so a device never has more than its share in flight. Anything sent
+// without a credit would be dropped, so hold reports until one arrives. A
+// newer report with the same ID replaces one still waiting, which keeps a
+// chatty device to one pending report per ID. Without report IDs in the
+// descriptor there is only the one report, and data[1] is just data.
+
+static void send_out(bthid_dev_t *dev, uint8_t *data, int len) {
+    dev->credits--;
+    dev->stats.reports_out++;
+    if (bt_send_l2cap(dev->cid_interrupt, data, len))
+        printf("WARNING: output report to %s failed\n", bd_addr_to_str(dev->addr));
+}
+
+static void drain_out(bthid_dev_t *dev) {
+    while (dev->credits > 0 && dev->outq_len) {
+        send_out(dev, dev->outq[0].data, dev->outq[0].len);
+        dev->outq_len--;
+        memmove(&dev->outq[0], &dev->outq[1], dev->outq_len * sizeof(bthid_out_report_t));
+    }
+}
+
+static void queue_out(bthid_dev_t *dev, uint8_t *data, int len) {
+    int i;
+    for (i=0; i<dev->outq_len; i++)
+        if (!dev->report_ids || dev->outq[i].data[1] == data[1])    // same report
+            break;
+    if (i == BTHID_OUT_QUEUE_LEN) {
+        printf("WARNING: output queue for %s full, dropping report\n", bd_addr_to_str(dev->addr));
+        return;
+    }
+    if (i == dev->outq_len)
+        dev->outq_len++;
+    memcpy(dev->outq[i].data, data, len);
+    dev->outq[i].len = len;
+}
+
 void bthid_report_out(bthid_dev_t *dev, uint8_t *report, int size) {
     uint8_t sndbuf[4097];
+    if (!dev->cid_interrupt || size < 1 || size > sizeof(sndbuf) - 1)
+        return;
     sndbuf[0] = 0xA2;   // DATA | report out
     memcpy(sndbuf+1, report, size);
-    bt_send_l2cap(dev->cid_interrupt, sndbuf, size+1);
+
+    if (dev->credits > 0 && !dev->outq_len) {
+        send_out(dev, sndbuf, size+1);
+        return;
+    }
+    if (size > BTHID_OUT_REPORT_LEN) {
+        printf("WARNING: output report to %s too long to queue, dropping\n", bd_addr_to_str(dev->addr));
+        return;
+    }
+    queue_out(dev, sndbuf, size+1);
+}
+// }}}
+
+// demand-driven forwarding {{{
+// while nobody has a device open, its reports are dropped as soon as they
+// arrive, and the link is asked to go into sniff mode to save power and
+// airtime. the first open brings it straight back.
+//
+// the controller refuses to exit sniff mode on a link that isn't in it, so
+// the mode is tracked from mode change events. an open or close while a
+// change is under way is acted on once it completes.
+
+#define LINK_ACTIVE     0
+#define LINK_ENTERING   1   // sniff_mode queued or sent
+#define LINK_SNIFF      2
+#define LINK_EXITING    3   // exit_sniff_mode sent
+
+static const hci_cmd_t sniff_mode = {
+    OPCODE(OGF_LINK_POLICY, 0x03), "H2222"
+};
+static const hci_cmd_t exit_sniff_mode = {
+    OPCODE(OGF_LINK_POLICY, 0x04), "H"
+};
+
+// in 0.625ms slots
+#define SNIFF_MAX_INTERVAL  800     // 500ms
+#define SNIFF_MIN_INTERVAL  400
+#define SNIFF_ATTEMPT       4
+#define SNIFF_TIMEOUT       1
+
+// move the link towards the mode the device's open state calls for
+static void update_link_mode(bthid_dev_t *dev) {
+    if (!dev->handle)
+        return;
+    if (dev->uhid_open) {
+        if (dev->link_mode == LINK_ENTERING && hcicmd_cancel(&sniff_mode, dev->handle)) {
+            dev->link_mode = LINK_ACTIVE;
+        } else if (dev->link_mode == LINK_SNIFF) {
+            hcicmd_send(HCICMD_URGENT, &exit_sniff_mode, dev->handle);
+            dev->link_mode = LINK_EXITING;
+        }
+    } else if (dev->link_mode == LINK_ACTIVE) {
+        hcicmd_send(HCICMD_BACKGROUND, &sniff_mode, dev->handle,
+                    SNIFF_MAX_INTERVAL, SNIFF_MIN_INTERVAL, SNIFF_ATTEMPT, SNIFF_TIMEOUT);
+        dev->link_mode = LINK_ENTERING;
+    }
+}
+
+void bthid_set_open(bthid_dev_t *dev, int open) {
+    if (dev->uhid_open == open)
+        return;
+    dev->uhid_open = open;
+    update_link_mode(dev);
+}
+
+static void link_mode_changed(uint8_t *packet) {
+    bthid_dev_t *dev = bthid_dev_for_handle(READ_BT_16(packet, 3));
+    if (!dev)
+        return;
+    if (packet[2]) {    // the change we asked for didn't happen
+        link_mode_failed(dev->link_mode == LINK_ENTERING ? sniff_mode.opcode : exit_sniff_mode.opcode,
+                         dev->handle);
+        return;
+    }
+    dev->link_mode = packet[5] == 0x02 ? LINK_SNIFF : LINK_ACTIVE;
+    // the device may have been opened or closed meanwhile
+    if (dev->link_mode == LINK_SNIFF ? dev->uhid_open : !dev->uhid_open)
+        update_link_mode(dev);
+}
+
+// no retrying: leave the link as it is until the device is next opened or
+// closed
+static void link_mode_failed(uint16_t opcode, uint16_t handle) {
+    bthid_dev_t *dev;
+    if (opcode != sniff_mode.opcode && opcode != exit_sniff_mode.opcode)
+        return;
+    if (!(dev = bthid_dev_for_handle(handle)))
+        return;
+    if (opcode == sniff_mode.opcode && dev->link_mode == LINK_ENTERING)
+        dev->link_mode = LINK_ACTIVE;
+    else if (opcode == exit_sniff_mode.opcode && dev->link_mode == LINK_EXITING)
+        dev->link_mode = LINK_SNIFF;
+}
+// }}}
+
+// our controller drops packets it hasn't delivered within the flush timeout,
+// rather than retransmitting them late. that covers what we send -- output
+// reports and control requests -- but not the device's reports, whose
+// retransmission is up to its own controller; BTstack gives us no way to
+// ask for a flush timeout in L2CAP configuration
+static const hci_cmd_t write_automatic_flush_timeout = {
+    OPCODE(OGF_CONTROLLER_BASEBAND, 0x28), "H2"
+};
+
+static void set_flush_timeout(bthid_dev_t *dev) {
+    hiddevs_link_t link;
+    if (!hiddevs_read_link(dev->addr, &link) || !link.flush_ms)
+        return;
+    int slots = link.flush_ms * 1000 / 625;     // in 0.625ms slots
+    if (slots > 0x7FF)
+        slots = 0x7FF;
+    if (slots < 1)
+        slots = 1;
+    hcicmd_send(HCICMD_NORMAL, &write_automatic_flush_timeout, dev->handle, slots);
 }
 
 // main packet handler. handles connection state {{{
@@ -251,19 +857,37 @@ void bthid_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet
         dev = finddev_cid(channel);
         if (!dev)
             return;
-        if (packet[0] == 0xA1)  // DATA | report in
-            uhid_report_in(dev, packet+1, size+1);
+        capture_packet(dev, channel, packet, size);
+        if (channel == dev->cid_control && (packet[0] & 0xF0) == HID_HANDSHAKE) {
+            boot_handshake(dev, packet[0] & 0x0F);
+            return;
+        }
+        // until the device confirms a protocol, its reports may not match
+        if (dev->boot == BOOT_ENTERING || dev->boot == BOOT_SWITCHING)
+            return;
+        if (packet[0] == 0xA1) {    // DATA | report in
+            dev->stats.reports_in++;
+            if (uhid_report_in(dev, packet+1, size-1) && !dev->got_report) {
+                dev->got_report = 1;
+                printf("First report from %s after %u ms\n", bd_addr_to_str(dev->addr), bthid_now_ms() - dev->connect_ms);
+            }
+        }
     }
 
     if (packet_type == HCI_EVENT_PACKET &&
         packet[0] == SDP_QUERY_COMPLETE) {
         dev = sdp_query_dev;
         sdp_query_dev = NULL;
-        pump_attributes(dev);
+        sdp_busy = 0;
+        if (dev)
+            pump_attributes(dev);
+        sdp_next();
     }
 
     if (packet_type != HCI_EVENT_PACKET)
         return;
+    hcicmd_event(packet, size);
+    linkstats_event(packet, size);
     switch (packet[0]) {
         case BTSTACK_EVENT_STATE:
             if (packet[2] != HCI_STATE_WORKING)
@@ -280,6 +904,8 @@ void bthid_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet
             dev = finddev_addr(remote);
             if (!dev)
                 dev = newdev(remote, 0);
+            if (dev)
+                dev->cod = packet[8] | (packet[9] << 8) | (packet[10] << 16);
             break;
 
         case HCI_EVENT_CONNECTION_COMPLETE:
@@ -287,7 +913,7 @@ void bthid_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet
                 break;
 
             bt_flip_addr(remote, &packet[5]);
-            if (!hiddevs_is_hid(remote))
+            if (!known_dev(remote))
                 break;
 
             printf("New connection\n");
@@ -300,10 +926,13 @@ void bthid_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet
                 break;
 
             dev->handle = handle;
+            dev->adopted = 0;
+            set_flush_timeout(dev);
+            linkstats_start();
             break;
 
         case HCI_EVENT_DISCONNECTION_COMPLETE:
-            dev = finddev_handle(READ_BT_16(packet, 3));
+            dev = bthid_dev_for_handle(READ_BT_16(packet, 3));
             if (dev) {
                 printf("Disconnected\n");
                 uhid_unregister(dev);
@@ -311,22 +940,29 @@ void bthid_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet
             }
             break;
 
+        case HCI_EVENT_MODE_CHANGE_EVENT:
+            link_mode_changed(packet);
+            break;
+
         case HCI_EVENT_READ_REMOTE_SUPPORTED_FEATURES_COMPLETE:
             handle = READ_BT_16(packet, 3);
-            if (dev = finddev_handle(handle))
-                bt_send_cmd(&hci_switch_role_command, &dev->addr, 0);  // go to master
+            if (dev = bthid_dev_for_handle(handle))
+                hcicmd_send(HCICMD_NORMAL, &hci_switch_role_command, &dev->addr, 0);  // go to master
             break;
 
         case BTSTACK_EVENT_REMOTE_NAME_CACHED:
         case HCI_EVENT_REMOTE_NAME_REQUEST_COMPLETE:
-            if (packet[2])
-                break;
             bt_flip_addr(remote, &packet[3]);
             dev = finddev_addr(remote);
-            if (!dev)
+            if (!dev || !dev->name_pending)
+                break;
+            if (packet[2]) {
+                name_failed(dev);
                 break;
+            }
+            dev->name_pending = 0;
             if (!dev->name)
-                dev->name = strdup(packet+9);
+                dev_set_name(dev, packet+9);
 
             pump_attributes(dev);
             break;
@@ -337,7 +973,7 @@ void bthid_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet
             psm = READ_BT_16(packet, 10); 
             local_cid = READ_BT_16(packet, 12); 
 
-            if (!hiddevs_is_hid(remote))
+            if (!known_dev(remote))
                 break;
 
             if (psm != PSM_HID_INTERRUPT &&
@@ -347,6 +983,11 @@ void bthid_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet
             dev = finddev_addr(remote);
             if (!dev)
                 dev = newdev(remote, handle);
+            if (!dev) {
+                // L2CAP result, not an HCI error: no resources available
+                bt_send_cmd(&l2cap_decline_connection, local_cid, 0x0004);
+                break;
+            }
 
             bt_send_cmd(&l2cap_accept_connection, local_cid);
             break;
@@ -354,7 +995,7 @@ void bthid_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet
         case L2CAP_EVENT_CHANNEL_OPENED:
             bt_flip_addr(remote, packet + 3);
 
-            if (!hiddevs_is_hid(remote))
+            if (!known_dev(remote))
                 break;
 
             dev = finddev_addr(remote);
@@ -371,20 +1012,55 @@ void bthid_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet
                     dev->cid_interrupt = local_cid;
             }
 
-            if (dev->outgoing)
-                outgoing_l2cap_open(dev, packet[2]);
+            if (dev->outgoing && outgoing_l2cap_open(dev, packet[2]))
+                break;
 
-            if (dev->cid_control && dev->cid_interrupt)
+            if (dev->cid_control && dev->cid_interrupt) {
+                start_boot(dev);
                 pump_attributes(dev);
+            }
+
+            break;
 
+        case L2CAP_EVENT_CREDITS:
+            local_cid = READ_BT_16(packet, 2);
+            dev = finddev_cid(local_cid);
+            if (!dev || local_cid != dev->cid_interrupt)
+                break;
+            dev->credits += packet[4];
+            drain_out(dev);
             break;
 
         case HCI_EVENT_LINK_KEY_REQUEST:
             bt_flip_addr(remote, &packet[2]);
+            dev = finddev_addr(remote);
+            if (dev && dev->pairing) {
+                printf("If using a keyboard, enter the PIN on the device now.\n");
+                hcicmd_send(HCICMD_URGENT, &hci_link_key_request_negative_reply, &remote);
+                break;
+            }
             link_key_t key;
             if (!hiddevs_read_link_key(remote, key))
                 break;
-            bt_send_cmd(&hci_link_key_request_reply, &remote, &key);
+            hcicmd_send(HCICMD_URGENT, &hci_link_key_request_reply, &remote, &key);
+            break;
+
+        case HCI_EVENT_PIN_CODE_REQUEST:
+            bt_flip_addr(remote, &packet[2]);
+            dev = finddev_addr(remote);
+            if (!dev || !dev->pairing)
+                break;
+            hcicmd_send(HCICMD_URGENT, &hci_pin_code_request_reply, &remote, strlen(dev->pin), dev->pin);
+            break;
+
+        case HCI_EVENT_LINK_KEY_NOTIFICATION:
+            bt_flip_addr(remote, &packet[2]);
+            dev = finddev_addr(remote);
+            if (!dev || !dev->pairing)
+                break;
+            printf("Pairing with %s succeeded!\n", bd_addr_to_str(remote));
+            hiddevs_add(remote, &packet[8]);
+            dev->pairing = 0;
             break;
     }
 }
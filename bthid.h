@@ -1,6 +1,57 @@
 #include <stdio.h>
 #include <btstack/run_loop.h>
 #include <btstack/utils.h>
+#include "remap.h"
+
+#ifdef BTHID_STATIC
+// fixed-footprint build: devices come from a preallocated pool, and
+// descriptors and names are stored inline, so nothing is allocated once
+// we are running
+#ifndef BTHID_MAX_DEVS
+#define BTHID_MAX_DEVS 8
+#endif
+#ifndef BTHID_MAX_DESCRIPTOR_LEN
+#define BTHID_MAX_DESCRIPTOR_LEN 1024
+#endif
+#endif
+
+// output reports waiting for L2CAP credit. longer reports are only sent
+// when the channel is idle
+#ifndef BTHID_OUT_QUEUE_LEN
+#define BTHID_OUT_QUEUE_LEN 4
+#endif
+#ifndef BTHID_OUT_REPORT_LEN
+#define BTHID_OUT_REPORT_LEN 64
+#endif
+
+typedef struct {
+    uint16_t len;
+    uint8_t data[BTHID_OUT_REPORT_LEN + 1];     // with DATA header
+} bthid_out_report_t;
+
+// report counters and radio link telemetry, see linkstats.c
+typedef struct {
+    uint32_t reports_in, reports_out;
+    uint32_t last_reports_in;   // at last poll
+    uint32_t last_poll_ms, next_poll_ms, interval_ms;
+    int rate;                   // input reports/s over the last poll period
+
+    // latest readings and moving averages (x16)
+    int8_t rssi;
+    uint8_t quality;
+    uint16_t failed_contacts;
+    int rssi_avg, quality_avg;
+    int samples;
+    int degraded;
+} bthid_link_stats_t;
+
+// remote names are at most 248 bytes, plus terminator
+#define BTHID_MAX_NAME_LEN 248
+
+#define BOOT_NONE       0
+#define BOOT_ACTIVE     1   // registered with the boot descriptor
+#define BOOT_SWITCHING  2   // asked for report protocol, awaiting handshake
+#define BOOT_ENTERING   3   // registered, asked for boot protocol, awaiting handshake
 
 typedef struct {
     // used in linked list. so, this must be first
@@ -9,24 +60,89 @@ typedef struct {
     // are we trying to establish this?
     int outgoing;
     int outgoing_retries;
+    // taken over from the previous process on restart, not yet reconnected
+    int adopted;
+    // pairing requested over the control socket, with this PIN
+    int pairing;
+    char pin[17];
 
     bd_addr_t addr;
     uint16_t handle;
     // L2CAP local channel numbers for each PSM
     uint16_t cid_interrupt, cid_control;
+    // nonzero while queued behind another device's SDP query; lower is older
+    unsigned int sdp_waiting;
     // raw HID descriptor
     uint8_t *descriptor;
     int descriptor_len;
+    // whether the descriptor numbers its reports
+    int report_ids;
     // PNPInformation attributes
     uint16_t vendor_id, product_id, version;
     uint8_t *name;
+    // remote name request outstanding, and how many have failed
+    int name_pending, name_failures;
+    // class of device, if the device connected to us. 0 if unknown
+    uint32_t cod;
+    // BOOT_* state, if we started it in boot protocol
+    int boot;
+    // SET_PROTOCOL requests not yet answered, and their timeout
+    int handshakes;
+    timer_source_t boot_timer;
+    // for reporting time to first report
+    uint32_t connect_ms;
+    int got_report;
+    // compiled remapping rules, NULL if there are none
+    remap_t *remap;
+#ifdef BTHID_STATIC
+    uint8_t descriptor_buf[BTHID_MAX_DESCRIPTOR_LEN];
+    uint8_t name_buf[BTHID_MAX_NAME_LEN + 1];
+    remap_t remap_buf;
+#endif
+
+    // interrupt channel credits from BTstack, and reports waiting on them
+    int credits;
+    int outq_len;
+    bthid_out_report_t outq[BTHID_OUT_QUEUE_LEN];
+
+    bthid_link_stats_t stats;
+
+    // index+1 in the capture file, or 0 if not being captured
+    int capture_id;
 
-    // uhid-side
+    // uhid-side. ds points at ds_buf while registered, NULL otherwise
     data_source_t *ds;
+    data_source_t ds_buf;
+    // UHID_START/STOP and UHID_OPEN/CLOSE from the kernel. input is only
+    // forwarded while someone has the device open
+    int uhid_started, uhid_open;
+    // whether the link is in sniff mode, or on its way in or out
+    int link_mode;
 } bthid_dev_t;
 
+// start keyboards and mice in boot protocol until their descriptor is known
+extern int bthid_boot_protocol;
+
 void bthid_packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
 void bthid_report_out(bthid_dev_t *dev, uint8_t *report, int size);
+void bthid_pair(bd_addr_t addr, const char *pin);
+void bthid_set_open(bthid_dev_t *dev, int open);
+// an HCI command that hcicmd gave up on, with its parameters
+void bthid_command_failed(uint16_t opcode, uint8_t *params);
+
+extern linked_list_t bthid_devs;
 
 // run loop handlers only get told ds, have to seek
 bthid_dev_t * bthid_dev_for_ds(data_source_t *ds);
+bthid_dev_t * bthid_dev_for_handle(uint16_t handle);
+
+// monotonic clock, for timing links
+uint32_t bthid_now_ms(void);
+
+// create an already-connected device with known attributes, for replay
+bthid_dev_t * bthid_replay_dev(bd_addr_t addr, uint16_t cid_base, uint8_t *name,
+        uint16_t vendor_id, uint16_t product_id, uint16_t version,
+        uint8_t *descriptor, int descriptor_len);
+bthid_dev_t * bthid_adopt_dev(bd_addr_t addr, uint8_t *name,
+        uint16_t vendor_id, uint16_t product_id, uint16_t version,
+        uint32_t cod, int boot, int open, uint8_t *descriptor, int descriptor_len, int fd);
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+// mallinfo2 is glibc 2.33 and later; other C libraries have nothing as good
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
+
+#include <btstack/btstack.h>
+#include <btstack/utils.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/linked_list.h>
+#include <btstack/run_loop.h>
+#include "bthid.h"
+#include "capture.h"
+#include "uhid.h"
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// recording {{{
+#define MAX_SELECTED 16
+// records are written out this often, rather than a syscall per report
+#define FLUSH_MS     1000
+
+static FILE *capture_file = NULL;
+static uint64_t capture_last;
+static int capture_ndevs = 0;
+static bd_addr_t selected[MAX_SELECTED];
+static int nselected = 0;
+static timer_source_t flush_timer;
+static int flush_armed = 0;
+
+static void write_record(int type, int id, uint8_t *data, int len);
+
+int capture_open(const char *path, int append) {
+    capture_file = fopen(path, append ? "ab" : "wb");
+    if (!capture_file) {
+        printf("ERROR: cannot open capture file %s\n", path);
+        return 1;
+    }
+    capture_last = now_usec();
+    fseek(capture_file, 0, SEEK_END);
+    if (!ftell(capture_file)) {
+        fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture_file);
+        fflush(capture_file);
+        return 0;
+    }
+
+    write_record(CAPTURE_RESTART, 0, NULL, 0);
+    linked_list_iterator_t it;
+    linked_list_iterator_init(&it, &bthid_devs);
+    while (linked_list_iterator_has_next(&it)) {
+        bthid_dev_t *dev = (bthid_dev_t *)linked_list_iterator_next(&it);
+        if (dev->name && dev->descriptor)
+            capture_device(dev);
+    }
+    return 0;
+}
+
+void capture_close(void) {
+    if (!capture_file)
+        return;
+    if (flush_armed) {
+        run_loop_remove_timer(&flush_timer);
+        flush_armed = 0;
+    }
+    fclose(capture_file);
+    capture_file = NULL;
+}
+
+// restrict capture to the given devices. with none selected, capture all
+void capture_select(bd_addr_t addr) {
+    if (nselected == MAX_SELECTED) {
+        printf("WARNING: too many capture devices, ignoring %s\n", bd_addr_to_str(addr));
+        return;
+    }
+    BD_ADDR_COPY(selected[nselected++], addr);
+}
+
+static int is_selected(bd_addr_t addr) {
+    int i;
+    if (!nselected)
+        return 1;
+    for (i=0; i<nselected; i++)
+        if (!BD_ADDR_CMP(selected[i], addr))
+            return 1;
+    return 0;
+}
+
+static void flush(timer_source_t *ts) {
+    flush_armed = 0;
+    fflush(capture_file);
+}
+
+static void write_record(int type, int id, uint8_t *data, int len) {
+    uint8_t hdr[CAPTURE_HEADER_LEN];
+    uint64_t now = now_usec();
+    uint64_t delta = now - capture_last;
+    capture_last = now;
+    if (delta > 0xffffffff)
+        delta = 0xffffffff;
+
+    bt_store_32(hdr, 0, delta);
+    hdr[4] = type;
+    hdr[5] = id;
+    bt_store_16(hdr, 6, len);
+    fwrite(hdr, 1, sizeof(hdr), capture_file);
+    fwrite(data, 1, len, capture_file);
+    if (!flush_armed) {
+        flush_timer.process = flush;
+        run_loop_set_timer(&flush_timer, FLUSH_MS);
+        run_loop_add_timer(&flush_timer);
+        flush_armed = 1;
+    }
+}
+
+// called once a device has all its attributes, before its uhid device exists
+void capture_device(bthid_dev_t *dev) {
+    uint8_t rec[6 + 6 + 1 + BTHID_MAX_NAME_LEN + 4096];
+    int name_len, len;
+
+    if (!capture_file || dev->capture_id || !is_selected(dev->addr))
+        return;
+    if (capture_ndevs == 255) {
+        printf("WARNING: capture device limit reached\n");
+        return;
+    }
+    if (dev->descriptor_len > 4096)
+        return;
+
+    dev->capture_id = ++capture_ndevs;
+
+    name_len = strlen((char *)dev->name);
+    BD_ADDR_COPY(rec, dev->addr);
+    bt_store_16(rec, 6, dev->vendor_id);
+    bt_store_16(rec, 8, dev->product_id);
+    bt_store_16(rec, 10, dev->version);
+    rec[12] = name_len;
+    memcpy(rec + 13, dev->name, name_len);
+    len = 13 + name_len;
+    memcpy(rec + len, dev->descriptor, dev->descriptor_len);
+    len += dev->descriptor_len;
+
+    write_record(CAPTURE_DEVICE, dev->capture_id, rec, len);
+}
+
+void capture_packet(bthid_dev_t *dev, uint16_t channel, uint8_t *packet, int size) {
+    if (!capture_file || !dev->capture_id)
+        return;
+    write_record(channel == dev->cid_control ? CAPTURE_CONTROL : CAPTURE_INTERRUPT,
+                 dev->capture_id, packet, size);
+}
+// }}}
+
+// measurement {{{
+// below 16 the buckets are exact; above, each power of two is split in 16
+static int hist_bucket(uint64_t ns) {
+    if (ns < 16)
+        return ns;
+    int e = 63 - __builtin_clzll(ns);
+    return (e - 3) * 16 + (int)((ns >> (e - 4)) & 15);
+}
+
+static uint64_t hist_top(int bucket) {
+    if (bucket < 16)
+        return bucket;
+    int e = bucket / 16 + 3;
+    return ((uint64_t)(17 + bucket % 16) << (e - 4)) - 1;
+}
+
+void capture_hist_add(capture_hist_t *h, uint64_t ns) {
+    h->n[hist_bucket(ns)]++;
+    h->count++;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+uint64_t capture_hist_percentile(capture_hist_t *h, int pct) {
+    uint64_t want = h->count * pct / 100, seen = 0;
+    int i;
+    for (i=0; i<CAPTURE_HIST_BUCKETS; i++) {
+        seen += h->n[i];
+        if (seen > want)
+            return hist_top(i) < h->max ? hist_top(i) : h->max;
+    }
+    return h->max;
+}
+
+void capture_mem_usage(uint64_t *heap, uint64_t *rss) {
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 mi = mallinfo2();
+    *heap = mi.uordblks + mi.hblkhd;
+#else
+    *heap = 0;
+#endif
+
+    // statm is in pages: size, resident, ...
+    char buf[64];
+    unsigned long size, resident = 0;
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd >= 0) {
+        int len = read(fd, buf, sizeof(buf) - 1);
+        if (len > 0) {
+            buf[len] = '\0';
+            sscanf(buf, "%lu %lu", &size, &resident);
+        }
+        close(fd);
+    }
+    *rss = (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+// }}}
+
+// replay {{{
+static uint64_t cpu_usec(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// feed a capture through bthid_packet_handler. uhid output goes to /dev/null
+// unless uhid_path has been changed. realtime keeps the original spacing
+// of packets, otherwise they are delivered as fast as possible.
+//
+// for scaling tests, each captured device is replayed as copies virtual
+// devices, with its own address and CIDs, all sending the same stream.
+int replay_run(const char *path, int realtime, int copies) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("ERROR: cannot open capture file %s\n", path);
+        return 1;
+    }
+
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+        printf("ERROR: %s is not a capture file\n", path);
+        fclose(f);
+        return 1;
+    }
+
+    // copies of capture device id are at replay_devs[id * copies + copy]
+    bthid_dev_t **replay_devs = calloc(256 * copies, sizeof(bthid_dev_t *));
+
+    static capture_hist_t hist;
+    memset(&hist, 0, sizeof(hist));
+    // device state is whatever the heap and RSS grow by while replaying
+    uint64_t heap0, rss0, heap1, rss1;
+    capture_mem_usage(&heap0, &rss0);
+
+    uint8_t hdr[CAPTURE_HEADER_LEN], data[65536];
+    uint64_t start = now_usec(), start_cpu = cpu_usec(), due = start, late_max = 0;
+    uint64_t packets = 0, bytes = 0;
+    int ndevs = 0, i;
+
+    while (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr)) {
+        uint32_t delta = READ_BT_32(hdr, 0);
+        int type = hdr[4], id = hdr[5], len = READ_BT_16(hdr, 6);
+        if (fread(data, 1, len, f) != len) {
+            printf("WARNING: truncated capture file\n");
+            break;
+        }
+
+        // every record's delta counts, device records included
+        due += delta;
+        if (realtime) {
+            uint64_t now = now_usec();
+            if (now < due) {
+                struct timespec ts = { (due - now) / 1000000, (due - now) % 1000000 * 1000 };
+                nanosleep(&ts, NULL);
+            } else if (now - due > late_max) {
+                late_max = now - due;
+            }
+        }
+
+        if (type == CAPTURE_RESTART) {
+            // the devices before it stay, but hear nothing more
+            memset(replay_devs, 0, 256 * copies * sizeof(bthid_dev_t *));
+            continue;
+        }
+        if (type == CAPTURE_DEVICE) {
+            if (len < 13 || 13 + data[12] > len || replay_devs[id * copies])
+                continue;
+            uint8_t name[BTHID_MAX_NAME_LEN + 1];
+            memcpy(name, data + 13, data[12]);
+            name[data[12]] = '\0';
+            for (i=0; i<copies; i++) {
+                bd_addr_t addr;
+                BD_ADDR_COPY(addr, data);
+                addr[4] ^= i >> 8;
+                addr[5] ^= i;
+                if (0x40 + 2*ndevs + 1 > 0xffff)
+                    break;
+                replay_devs[id * copies + i] = bthid_replay_dev(addr, 0x40 + 2*ndevs, name,
+                        READ_BT_16(data, 6), READ_BT_16(data, 8), READ_BT_16(data, 10),
+                        data + 13 + data[12], len - 13 - data[12]);
+                if (replay_devs[id * copies + i])
+                    ndevs++;
+            }
+            continue;
+        }
+
+        for (i=0; i<copies; i++) {
+            bthid_dev_t *dev = replay_devs[id * copies + i];
+            if (!dev)
+                continue;
+
+            uint16_t cid = type == CAPTURE_CONTROL ? dev->cid_control : dev->cid_interrupt;
+            uint64_t t0 = now_nsec();
+            bthid_packet_handler(L2CAP_DATA_PACKET, cid, data, len);
+            capture_hist_add(&hist, now_nsec() - t0);
+            packets++;
+            bytes += len;
+        }
+    }
+    fclose(f);
+
+    uint64_t elapsed = now_usec() - start;
+    uint64_t cpu = cpu_usec() - start_cpu;
+    capture_mem_usage(&heap1, &rss1);
+    printf("replayed %llu packets (%llu bytes) for %d devices in %llu us\n",
+           (unsigned long long)packets, (unsigned long long)bytes, ndevs, (unsigned long long)elapsed);
+    if (packets) {
+        unsigned long long p50 = capture_hist_percentile(&hist, 50);
+        unsigned long long p99 = capture_hist_percentile(&hist, 99);
+        printf("throughput: %.0f packets/s\n", packets * 1e6 / (elapsed ? elapsed : 1));
+        printf("handling latency ns: p50 %llu p99 %llu max %llu\n",
+               p50, p99, (unsigned long long)hist.max);
+        if (realtime)
+            printf("worst lateness: %llu us\n", (unsigned long long)late_max);
+
+        // one line of key=value, for diffing between releases
+        printf("bench devices=%d packets=%llu elapsed_us=%llu cpu_us=%llu "
+               "cpu_ns_per_report=%llu p50_ns=%llu p99_ns=%llu max_ns=%llu "
+               "heap_bytes_per_dev=%lld rss_bytes_per_dev=%lld\n",
+               ndevs, (unsigned long long)packets, (unsigned long long)elapsed, (unsigned long long)cpu,
+               (unsigned long long)(cpu * 1000 / packets), p50, p99,
+               (unsigned long long)hist.max,
+               ndevs ? (long long)(heap1 - heap0) / ndevs : 0,
+               ndevs ? (long long)(rss1 - rss0) / ndevs : 0);
+    }
+    free(replay_devs);
+    return 0;
+}
+// }}}
@@ -0,0 +1,35 @@
+// capture file records. all values little-endian
+#define CAPTURE_MAGIC       "THIDCAP1"
+#define CAPTURE_DEVICE      1   // addr, vid, pid, version, name len, name, descriptor
+#define CAPTURE_INTERRUPT   2   // raw packet from interrupt channel
+#define CAPTURE_CONTROL     3   // raw packet from control channel
+#define CAPTURE_RESTART     4   // tinyhidd restarted: device ids start over
+
+// each record: u32 usec since previous record, u8 type, u8 device, u16 len, data
+#define CAPTURE_HEADER_LEN  8
+
+// append is for taking over from a previous process that was capturing to
+// the same file; the devices taken over are recorded again
+int capture_open(const char *path, int append);
+void capture_close(void);
+void capture_select(bd_addr_t addr);
+void capture_device(bthid_dev_t *dev);
+void capture_packet(bthid_dev_t *dev, uint16_t channel, uint8_t *packet, int size);
+
+int replay_run(const char *path, int realtime, int copies);
+
+// latency histogram in ns, 16 buckets per power of two, so percentiles are
+// within about 6% from 16ns up
+#define CAPTURE_HIST_BUCKETS (61 * 16)
+typedef struct {
+    uint32_t n[CAPTURE_HIST_BUCKETS];
+    uint64_t count, max;
+} capture_hist_t;
+
+void capture_hist_add(capture_hist_t *h, uint64_t ns);
+// top of the bucket the pct'th percentile falls in, or max if lower
+uint64_t capture_hist_percentile(capture_hist_t *h, int pct);
+
+// heap in use and resident set size, in bytes. doesn't allocate. heap is
+// always 0 where the C library can't tell (anything but glibc 2.33+)
+void capture_mem_usage(uint64_t *heap, uint64_t *rss);
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+#include "bthid.h"
+#include "ctl.h"
+#include "handoff.h"
+
+static data_source_t ctl_ds;
+
+static void command(char *cmd) {
+    char *verb = strtok(cmd, " \n");
+    if (!verb)
+        return;
+
+    if (!strcmp(verb, "pair")) {
+        char *addr_s = strtok(NULL, " \n");
+        char *pin = strtok(NULL, " \n");
+        bd_addr_t addr;
+        if (!addr_s || strlen(addr_s) != 17 || !sscan_bd_addr((uint8_t *)addr_s, addr) ||
+            !pin || strlen(pin) > 16) {
+            printf("Bad pair command\n");
+            return;
+        }
+        bthid_pair(addr, pin);
+        return;
+    }
+
+    if (!strcmp(verb, "restart")) {
+        handoff_restart();
+        return;
+    }
+
+    printf("Unknown control command \"%s\"\n", verb);
+}
+
+static int process(data_source_t *ds) {
+    char buf[128];
+    int n = recv(ds->fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    command(buf);
+    return 0;
+}
+
+int ctl_open(void) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, CTL_SOCKET, sizeof(sa.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        printf("WARNING: cannot create control socket\n");
+        return 1;
+    }
+    unlink(CTL_SOCKET);
+    // pairing is as sensitive as the hiddevs file
+    mode_t mask = umask(0077);
+    int err = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+    umask(mask);
+    if (err < 0) {
+        printf("WARNING: cannot bind control socket " CTL_SOCKET "\n");
+        close(fd);
+        return 1;
+    }
+
+    ctl_ds.fd = fd;
+    ctl_ds.process = process;
+    run_loop_add_data_source(&ctl_ds);
+    return 0;
+}
@@ -0,0 +1,7 @@
+// local control socket, for asking a running tinyhidd to do things.
+// datagrams of text commands:
+//   pair <address> <pin>
+//   restart                 re-execute, keeping uhid devices (see handoff.h)
+#define CTL_SOCKET "tinyhidd.ctl"
+
+int ctl_open(void);
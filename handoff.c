@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <btstack/btstack.h>
+#include <btstack/utils.h>
+#include <btstack/linked_list.h>
+#include "bthid.h"
+#include "capture.h"
+#include "handoff.h"
+
+// bump when the record layout changes, so a mismatched binary refuses it
+#define HANDOFF_MAGIC 0x74680003
+
+// how long the new process gets to take the devices
+#define HANDOFF_TIMEOUT_MS 5000
+
+// one message per device: this, then name and descriptor, with the uhid fd
+// attached. a u32 count of the devices sent ends the list, and the new
+// process answers with a u32 count of those it adopted. once the old
+// process has let go of BTstack, it hangs up.
+typedef struct {
+    uint32_t magic;
+    bd_addr_t addr;
+    uint16_t vendor_id, product_id, version;
+    uint32_t cod;
+    int boot, open;
+    uint16_t name_len, descriptor_len;
+} handoff_rec_t;
+
+static int saved_argc;
+static char **saved_argv;
+
+void handoff_init(int argc, char **argv) {
+    saved_argc = argc;
+    saved_argv = argv;
+}
+
+// exec ourselves again (by name, so an upgraded binary is picked up) with
+// -H and the fd to receive state on
+static void exec_child(int fd) {
+    char **argv = malloc((saved_argc + 3) * sizeof(char *));
+    char fd_str[16];
+    int i, n = 0;
+
+    // nothing but the handoff socket and stdio should leak across,
+    // especially not our BTstack connection
+    for (i=3; i<1024; i++)
+        if (i != fd)
+            close(i);
+
+    for (i=0; i<saved_argc; i++) {
+        if (!strcmp(saved_argv[i], "-H")) {     // from an earlier restart
+            i++;
+            continue;
+        }
+        argv[n++] = saved_argv[i];
+    }
+    snprintf(fd_str, sizeof(fd_str), "%d", fd);
+    argv[n++] = "-H";
+    argv[n++] = fd_str;
+    argv[n] = NULL;
+
+    execvp(argv[0], argv);
+    printf("ERROR: cannot execute %s for restart\n", argv[0]);
+    _exit(1);
+}
+
+static int send_dev(int fd, bthid_dev_t *dev) {
+    handoff_rec_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = HANDOFF_MAGIC;
+    BD_ADDR_COPY(rec.addr, dev->addr);
+    rec.vendor_id = dev->vendor_id;
+    rec.product_id = dev->product_id;
+    rec.version = dev->version;
+    rec.cod = dev->cod;
+    rec.boot = dev->boot ? BOOT_ACTIVE : BOOT_NONE;    // boot descriptor or not
+    rec.open = dev->uhid_open;
+    rec.name_len = dev->name ? strlen((char *)dev->name) : 0;
+    rec.descriptor_len = dev->descriptor ? dev->descriptor_len : 0;
+
+    struct iovec iov[3] = {
+        { &rec, sizeof(rec) },
+        { dev->name, rec.name_len },
+        { dev->descriptor, rec.descriptor_len },
+    };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &dev->ds->fd, sizeof(int));
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) < 0;
+}
+
+// the new process's count of adopted devices, or -1 if it doesn't answer
+static int wait_ack(int fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    uint32_t count;
+    if (poll(&pfd, 1, HANDOFF_TIMEOUT_MS) != 1 ||
+        recv(fd, &count, sizeof(count), 0) != sizeof(count))
+        return -1;
+    return count;
+}
+
+void handoff_restart(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        printf("ERROR: cannot create restart socket\n");
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("ERROR: cannot fork for restart\n");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (!pid)
+        exec_child(sv[1]);
+    close(sv[1]);
+
+    printf("Restarting, handing devices to pid %d\n", pid);
+
+    uint32_t sent = 0;
+    int adopted = -1;
+    linked_list_iterator_t it;
+    linked_list_iterator_init(&it, &bthid_devs);
+    while (linked_list_iterator_has_next(&it)) {
+        bthid_dev_t *dev = (bthid_dev_t *)linked_list_iterator_next(&it);
+        if (!dev->ds)   // not set up yet; it will just reconnect
+            continue;
+        if (send_dev(sv[0], dev)) {
+            printf("WARNING: failed to hand over %s\n", bd_addr_to_str(dev->addr));
+            goto failed;
+        }
+        sent++;
+    }
+    if (send(sv[0], &sent, sizeof(sent), MSG_NOSIGNAL) != sizeof(sent) ||
+        (adopted = wait_ack(sv[0])) < 0)
+        goto failed;
+
+    printf("pid %d took over %d of %u devices\n", pid, adopted, sent);
+    // let go of BTstack, then hang up to tell the new process it can have
+    // it. it holds the uhid fds now, so exiting doesn't destroy them
+    bt_close();
+    capture_close();
+    close(sv[0]);
+    exit(0);
+
+failed:
+    // the new process exits without destroying the uhid devices it got,
+    // as we still hold them too
+    printf("WARNING: restart failed, carrying on\n");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(sv[0]);
+}
+
+// called by the new process, before connecting to BTstack. returns nonzero
+// if the old process gave up on the restart, and we should exit at once
+int handoff_receive(int fd) {
+    uint8_t buf[sizeof(handoff_rec_t) + BTHID_MAX_NAME_LEN + 4096];
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    uint32_t ndevs = 0, sent;
+
+    for (;;) {
+        struct iovec iov = { buf, sizeof(buf) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        int n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            printf("ERROR: restart abandoned\n");
+            return 1;
+        }
+        if (n == sizeof(sent)) {
+            memcpy(&sent, buf, sizeof(sent));
+            break;
+        }
+
+        int uhid_fd = -1;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&uhid_fd, CMSG_DATA(cmsg), sizeof(int));
+
+        handoff_rec_t *rec = (handoff_rec_t *)buf;
+        if (n < sizeof(*rec) || rec->magic != HANDOFF_MAGIC ||
+            sizeof(*rec) + rec->name_len + rec->descriptor_len != n ||
+            rec->name_len > BTHID_MAX_NAME_LEN || uhid_fd < 0) {
+            printf("ERROR: bad device in restart state\n");
+            if (uhid_fd >= 0)
+                close(uhid_fd);
+            continue;
+        }
+
+        uint8_t name[BTHID_MAX_NAME_LEN + 1];
+        memcpy(name, buf + sizeof(*rec), rec->name_len);
+        name[rec->name_len] = '\0';
+
+        if (bthid_adopt_dev(rec->addr, rec->name_len ? name : NULL,
+                rec->vendor_id, rec->product_id, rec->version, rec->cod, rec->boot, rec->open,
+                buf + sizeof(*rec) + rec->name_len, rec->descriptor_len, uhid_fd))
+            ndevs++;
+        else
+            close(uhid_fd);
+    }
+    printf("Took over %u of %u devices\n", ndevs, sent);
+
+    // wait for the old process to let go of BTstack
+    char c;
+    if (send(fd, &ndevs, sizeof(ndevs), MSG_NOSIGNAL) != sizeof(ndevs) ||
+        recv(fd, &c, 1, 0) != 0) {
+        printf("ERROR: restart abandoned\n");
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,7 @@
+// live restart: the running daemon hands its devices, including their open
+// uhid fds, to a freshly executed copy of itself, so input devices survive
+// an upgrade. only the Bluetooth side has to reconnect.
+
+void handoff_init(int argc, char **argv);
+void handoff_restart(void);
+int handoff_receive(int fd);
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <btstack/btstack.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+#include "bthid.h"
+#include "hcicmd.h"
+
+#define MAX_RETRIES     3
+#define TIMEOUT_MS      2000
+// a busy controller is asked again after this, times the attempt number
+#define RETRY_DELAY_MS  20
+// controllers take a command or two at a time, so this is plenty
+#define MAX_IN_FLIGHT   16
+
+#define SLOT_FREE       0
+#define SLOT_QUEUED     1
+#define SLOT_SENT       2   // awaiting command status or complete
+#define SLOT_BACKOFF    3   // refused for now; queued again by retry_timer
+
+typedef struct {
+    int state;
+    int prio;
+    unsigned int seq;       // for FIFO order within a priority
+    int retries;
+    uint16_t opcode;
+    // the connection handle or address the command is for, as sent. command
+    // complete events echo it back first thing after the status
+    int key_len;
+    uint16_t len;
+    uint8_t buf[3 + 255];
+} hcicmd_t;
+
+// a few commands per device can be waiting at once, eg. while they all
+// connect together
+#ifdef BTHID_STATIC
+#define QUEUE_LEN       (BTHID_MAX_DEVS * 4)
+static hcicmd_t slots[QUEUE_LEN];
+static const int nslots = QUEUE_LEN;
+#else
+static hcicmd_t *slots = NULL;
+static int nslots = 0;
+#endif
+static unsigned int next_seq = 0;
+// commands the controller will currently accept
+static int credits = 1;
+static timer_source_t timeout;
+static int timeout_armed = 0;
+static timer_source_t retry_timer;
+static int retry_armed = 0;
+static void (*failure_handler)(uint16_t opcode, uint8_t *params) = NULL;
+
+void hcicmd_register_failure_handler(void (*handler)(uint16_t opcode, uint8_t *params)) {
+    failure_handler = handler;
+}
+
+static void failed(uint16_t opcode, uint8_t *params) {
+    if (failure_handler)
+        failure_handler(opcode, params);
+}
+
+static int retriable(uint8_t status) {
+    switch (status) {
+        case 0x07:  // memory capacity exceeded
+        case 0x0C:  // command disallowed
+        case 0x0D:  // rejected, limited resources
+        case 0x3A:  // controller busy
+            return 1;
+    }
+    return 0;
+}
+
+static void arm_timeout(void);
+
+// give up on a command, and say so in case someone was waiting on it
+static void fail(hcicmd_t *c) {
+    uint8_t buf[3 + 255];
+    memcpy(buf, c->buf, c->len);
+    c->state = SLOT_FREE;
+    failed(c->opcode, buf + 3);
+}
+
+// command status events say nothing about which connection they are for,
+// so only one command per opcode is sent at a time. the opcodes in flight
+// are gathered first, so this stays linear in the queue length
+static void run_queue(void) {
+    uint16_t sent[MAX_IN_FLIGHT];
+    int nsent = 0, i, j;
+
+    for (i=0; i<nslots; i++) {
+        if (slots[i].state != SLOT_SENT)
+            continue;
+        if (nsent == MAX_IN_FLIGHT)
+            return;
+        sent[nsent++] = slots[i].opcode;
+    }
+
+    while (credits > 0 && nsent < MAX_IN_FLIGHT) {
+        hcicmd_t *next = NULL;
+        for (i=0; i<nslots; i++) {
+            hcicmd_t *c = &slots[i];
+            if (c->state != SLOT_QUEUED)
+                continue;
+            for (j=0; j<nsent && sent[j] != c->opcode; j++)
+                ;
+            if (j < nsent)
+                continue;
+            if (!next || c->prio < next->prio ||
+                (c->prio == next->prio && (int)(c->seq - next->seq) < 0))
+                next = c;
+        }
+        if (!next)
+            return;
+
+        credits--;
+        next->state = SLOT_SENT;
+        sent[nsent++] = next->opcode;
+        bt_send_packet(HCI_COMMAND_DATA_PACKET, 0, next->buf, next->len);
+        arm_timeout();
+    }
+}
+
+// if the controller never answers, don't stall everything behind it
+static void timed_out(timer_source_t *ts) {
+    int i;
+    timeout_armed = 0;
+    for (i=0; i<nslots; i++) {
+        if (slots[i].state == SLOT_SENT) {
+            printf("WARNING: HCI command 0x%04X got no response\n", slots[i].opcode);
+            fail(&slots[i]);
+        }
+    }
+    credits = 1;
+    run_queue();
+}
+
+// commands waiting out a backoff all go back in the queue together, when
+// the first of their delays is up
+static void retry_now(timer_source_t *ts) {
+    int i;
+    retry_armed = 0;
+    for (i=0; i<nslots; i++)
+        if (slots[i].state == SLOT_BACKOFF)
+            slots[i].state = SLOT_QUEUED;
+    run_queue();
+}
+
+static void backoff(hcicmd_t *c) {
+    c->state = SLOT_BACKOFF;
+    if (retry_armed)
+        return;
+    retry_timer.process = retry_now;
+    run_loop_set_timer(&retry_timer, RETRY_DELAY_MS * c->retries);
+    run_loop_add_timer(&retry_timer);
+    retry_armed = 1;
+}
+
+static void arm_timeout(void) {
+    if (timeout_armed)
+        run_loop_remove_timer(&timeout);
+    timeout.process = timed_out;
+    run_loop_set_timer(&timeout, TIMEOUT_MS);
+    run_loop_add_timer(&timeout);
+    timeout_armed = 1;
+}
+
+// when the queue is full it grows, or in the static build a command pushes
+// out the least urgent one still waiting, if that is less urgent than
+// itself. otherwise it is dropped
+static hcicmd_t * find_slot(int prio) {
+    hcicmd_t *victim = NULL;
+    int i;
+    for (i=0; i<nslots; i++) {
+        hcicmd_t *c = &slots[i];
+        if (c->state == SLOT_FREE)
+            return c;
+        if (c->state == SLOT_QUEUED && c->prio > prio &&
+            (!victim || c->prio > victim->prio ||
+             (c->prio == victim->prio && (int)(c->seq - victim->seq) > 0)))
+            victim = c;
+    }
+#ifndef BTHID_STATIC
+    hcicmd_t *more = realloc(slots, (nslots + 16) * sizeof(hcicmd_t));
+    if (more) {
+        slots = more;
+        memset(&slots[nslots], 0, 16 * sizeof(hcicmd_t));
+        nslots += 16;
+        return &slots[nslots - 16];
+    }
+#endif
+    printf("WARNING: HCI command queue full\n");
+    return victim;
+}
+
+void hcicmd_send(int prio, const hci_cmd_t *cmd, ...) {
+    uint8_t buf[3 + 255];
+    va_list argptr;
+    va_start(argptr, cmd);
+    uint16_t len = hci_create_cmd_internal(buf, cmd, argptr);
+    va_end(argptr);
+
+    hcicmd_t *c = find_slot(prio);
+    if (!c) {
+        failed(cmd->opcode, buf + 3);
+        return;
+    }
+    hcicmd_t old = *c;
+    memcpy(c->buf, buf, len);
+    c->len = len;
+    c->state = SLOT_QUEUED;
+    c->prio = prio;
+    c->seq = next_seq++;
+    c->retries = 0;
+    c->opcode = cmd->opcode;
+    switch (cmd->format[0]) {
+        case 'H': c->key_len = 2; break;
+        case 'B': c->key_len = BD_ADDR_LEN; break;
+        default:  c->key_len = 0;
+    }
+    if (old.state != SLOT_FREE)
+        failed(old.opcode, old.buf + 3);
+    run_queue();
+}
+
+int hcicmd_cancel(const hci_cmd_t *cmd, uint16_t handle) {
+    int i;
+    for (i=0; i<nslots; i++) {
+        hcicmd_t *c = &slots[i];
+        if ((c->state == SLOT_QUEUED || c->state == SLOT_BACKOFF) && c->opcode == cmd->opcode &&
+            c->key_len == 2 && READ_BT_16(c->buf, 3) == handle) {
+            c->state = SLOT_FREE;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the command we sent with this opcode. key is the handle or address the
+// event is for, or NULL if it doesn't say
+static hcicmd_t * find_sent(uint16_t opcode, uint8_t *key, int key_len) {
+    int i;
+    for (i=0; i<nslots; i++) {
+        hcicmd_t *c = &slots[i];
+        if (c->state != SLOT_SENT || c->opcode != opcode)
+            continue;
+        if (key && c->key_len && key_len >= c->key_len && memcmp(key, c->buf + 3, c->key_len))
+            return NULL;
+        return c;
+    }
+    return NULL;
+}
+
+static void completed(uint16_t opcode, uint8_t status, uint8_t *key, int key_len) {
+    hcicmd_t *c = find_sent(opcode, key, key_len);
+    if (!c)
+        return;     // not one of ours, eg. sent by BTstack itself
+
+    if (!status) {
+        c->state = SLOT_FREE;
+        return;
+    }
+    if (retriable(status) && c->retries++ < MAX_RETRIES) {
+        backoff(c);
+        return;
+    }
+    printf("WARNING: HCI command 0x%04X failed (status 0x%02X)\n", opcode, status);
+    fail(c);
+}
+
+// feed HCI events through here to track credits and command results
+void hcicmd_event(uint8_t *packet, int size) {
+    uint16_t opcode;
+    int status = -1;
+    uint8_t *key = NULL;
+    int key_len = 0;
+
+    switch (packet[0]) {
+        case HCI_EVENT_COMMAND_COMPLETE:
+            if (size < 5)
+                return;
+            opcode = READ_BT_16(packet, 3);
+            if (opcode >> 10 == OGF_BTSTACK)    // made up by the daemon
+                return;
+            credits = packet[2];
+            if (size >= 6)
+                status = packet[5];
+            key = packet + 6;
+            key_len = size - 6;
+            break;
+
+        case HCI_EVENT_COMMAND_STATUS:
+            if (size < 6)
+                return;
+            opcode = READ_BT_16(packet, 4);
+            if (opcode >> 10 == OGF_BTSTACK)
+                return;
+            credits = packet[3];
+            status = packet[2];
+            break;
+
+        default:
+            return;
+    }
+
+    if (status >= 0)
+        completed(opcode, status, key, key_len);
+
+    if (timeout_armed) {
+        run_loop_remove_timer(&timeout);
+        timeout_armed = 0;
+    }
+    int i;
+    for (i=0; i<nslots; i++) {
+        if (slots[i].state == SLOT_SENT) {
+            arm_timeout();
+            break;
+        }
+    }
+    run_queue();
+}
@@ -0,0 +1,21 @@
+// scheduling of HCI commands to the controller. commands are queued until
+// the controller has room for them (Num_HCI_Command_Packets), urgent ones
+// first, and retried if the controller is too busy to take them.
+//
+// BTstack daemon commands (l2cap_*, sdp_*, btstack_*) don't go to the
+// controller, so keep using bt_send_cmd for those.
+//
+// commands that fail for good -- refused by the controller, never answered
+// or pushed out of a full queue -- are passed to the failure handler, if one
+// is registered, with their parameters.
+
+#define HCICMD_URGENT       0   // someone is waiting on it, eg. link key replies
+#define HCICMD_NORMAL       1
+#define HCICMD_BACKGROUND   2   // eg. remote name requests, telemetry
+
+void hcicmd_send(int prio, const hci_cmd_t *cmd, ...);
+void hcicmd_event(uint8_t *packet, int size);
+// drop a command for this connection that hasn't been sent yet. returns 1 if
+// there was one
+int hcicmd_cancel(const hci_cmd_t *cmd, uint16_t handle);
+void hcicmd_register_failure_handler(void (*handler)(uint16_t opcode, uint8_t *params));
@@ -1,9 +1,9 @@
-#define _GNU_SOURCE // for strcasestr
-
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include <btstack/btstack.h>
 #include <btstack/utils.h>
@@ -11,118 +11,269 @@
 #include "hiddevs.h"
 
 // XXX should make this a command-line option
-#define HIDDEVS_FILE "hiddevs"
+const char *hiddevs_db_file = "hiddevs";
 
-int hiddevs_add(bd_addr_t addr, link_key_t key) {
-    if (hiddevs_is_hid(addr))
-        return 0;
+// the file is cached in memory, and reread whenever it changes on disk
+// (eg. tinyhidd-pair has added a device). changes are written through.
+typedef struct {
+    bd_addr_t addr;
+    link_key_t key;
+    hiddevs_link_t link;
+    char opts[64];      // rest of the line, kept as written
+} hiddev_t;
 
-    // contains link keys, so keep secret
-    int fd = open(HIDDEVS_FILE, O_WRONLY|O_CREAT|O_APPEND, 0600);
-    if (fd < 0) {
-        printf("WARNING - could not open " HIDDEVS_FILE " for writing\n");
-        return 1;
+// link settings for device classes, used with eg. "class=mouse" after the
+// key. an explicit "mtu=" overrides these, and an mtu of 0 means the
+// default. the class of device is what an incoming connection would have
+// told us.
+//
+// no class gets a flush timeout: it only covers what we send, and a
+// dropped LED or rumble-off report is worse than a late one
+static const struct {
+    const char *name;
+    uint16_t mtu;
+    uint32_t cod;
+} classes[] = {
+    { "keyboard",   0, 0x002540 },
+    { "mouse",      0, 0x002580 },
+    { "gamepad",    0, 0x002508 },
+    { "tablet",   672, 0x002514 },
+    { "touch",    672, 0x002514 },
+};
+
+static void parse_opts(hiddev_t *dev, char *opts) {
+    char *opt;
+    int i;
+
+    memset(&dev->link, 0, sizeof(dev->link));
+    strncpy(dev->opts, opts, sizeof(dev->opts) - 1);
+    dev->opts[sizeof(dev->opts) - 1] = '\0';
+
+    for (opt = strtok(opts, " \n"); opt; opt = strtok(NULL, " \n")) {
+        if (!strncmp(opt, "class=", 6)) {
+            for (i=0; i<sizeof(classes)/sizeof(classes[0]); i++) {
+                if (!strcmp(opt + 6, classes[i].name)) {
+                    if (!dev->link.mtu)
+                        dev->link.mtu = classes[i].mtu;
+                    dev->link.cod = classes[i].cod;
+                    break;
+                }
+            }
+            if (i == sizeof(classes)/sizeof(classes[0]))
+                printf("Unknown device class in %s: \"%s\"\n", hiddevs_db_file, opt + 6);
+        } else if (!strncmp(opt, "mtu=", 4)) {
+            int mtu = atoi(opt + 4);
+            dev->link.mtu = mtu < 0 ? 0 : mtu > 0xFFFF ? 0xFFFF : mtu;
+        } else if (!strncmp(opt, "flush=", 6)) {
+            dev->link.flush_ms = atoi(opt + 6);
+        } else {
+            printf("Unknown option in %s: \"%s\"\n", hiddevs_db_file, opt);
+        }
+    }
+
+    if (dev->link.mtu && dev->link.mtu < HIDDEVS_MIN_MTU)
+        dev->link.mtu = HIDDEVS_MIN_MTU;
+    if (dev->link.mtu > HIDDEVS_MAX_MTU) {
+        printf("WARNING: mtu in %s limited to %d\n", hiddevs_db_file, HIDDEVS_MAX_MTU);
+        dev->link.mtu = HIDDEVS_MAX_MTU;
     }
-    int ret = 0;
-
-    const char *str;
-    str = bd_addr_to_str(addr);
-    if (write(fd, str, strlen(str)) < strlen(str))
-        ret = 1;
-    
-    if (write(fd, " ", 1) < 1)
-        ret = 1;
-
-    str = link_key_to_str(key);
-    if (write(fd, str, strlen(str)) < strlen(str))
-        ret = 1;
-
-    if (write(fd, "\n", 1) < 1)
-        ret = 1;
-    close(fd);
-    return ret;
 }
 
-static int check_and_remove(bd_addr_t addr, int remove, link_key_t key) {
-    int mode = remove ? O_RDWR : O_RDONLY;
-    int fd = open(HIDDEVS_FILE, mode);
-    if (fd < 0) {
-        // printf("WARNING - could not open " HIDDEVS_FILE "\n");
-        return 0;
+static hiddev_t *devs = NULL;
+static int ndevs = 0, maxdevs = 0;
+static struct timespec loaded_mtime;
+static int loaded = 0;
+
+static hiddev_t * append(bd_addr_t addr, link_key_t key) {
+    if (ndevs == maxdevs) {
+        maxdevs = maxdevs ? maxdevs * 2 : 16;
+        devs = realloc(devs, maxdevs * sizeof(hiddev_t));
+    }
+    hiddev_t *dev = &devs[ndevs++];
+    BD_ADDR_COPY(dev->addr, addr);
+    memcpy(dev->key, key, LINK_KEY_LEN);
+    memset(&dev->link, 0, sizeof(dev->link));
+    dev->opts[0] = '\0';
+    return dev;
+}
+
+static void load(void) {
+    struct stat st;
+    if (stat(hiddevs_db_file, &st) < 0) {
+        ndevs = 0;
+        loaded = 0;
+        return;
     }
+    if (loaded &&
+        st.st_mtim.tv_sec == loaded_mtime.tv_sec &&
+        st.st_mtim.tv_nsec == loaded_mtime.tv_nsec)
+        return;
 
-    char buf[4096];
-    int n = read(fd, buf, sizeof(buf));
-    if (n == sizeof(buf)) {
-        printf("WARNING - hiddevs file is ridiculously big, will be truncated\n");
-        n--;
+    FILE *f = fopen(hiddevs_db_file, "r");
+    if (!f)
+        return;
+    loaded = 1;
+    loaded_mtime = st.st_mtim;
+    ndevs = 0;
+
+    char line[256];
+    bd_addr_t addr;
+    link_key_t key;
+    while (fgets(line, sizeof(line), f)) {
+        char *p = strtok(line, " \n");
+        char *k = strtok(NULL, " \n");
+        char *opts = strtok(NULL, "\n");
+        if (!p || *p == '#')     // blank, or a comment
+            continue;
+        if (strlen(p) != 17 || !sscan_bd_addr((uint8_t *)p, addr) ||
+            !k || strlen(k) != 2*LINK_KEY_LEN || !sscan_link_key(k, key)) {
+            printf("Malformatted line in %s: \"%s\"\n", hiddevs_db_file, p);
+            continue;
+        }
+        hiddev_t *dev = append(addr, key);
+        if (opts)
+            parse_opts(dev, opts);
     }
-    buf[n] = '\0';
+    fclose(f);
+}
 
-    char *addr_str = bd_addr_to_str(addr);
-    char *found = strcasestr(buf, addr_str);
+static hiddev_t * find(bd_addr_t addr) {
+    int i;
+    load();
+    for (i=0; i<ndevs; i++)
+        if (!BD_ADDR_CMP(devs[i].addr, addr))
+            return &devs[i];
+    return NULL;
+}
 
-    if (found && key)
-        sscan_link_key(found + 3*BD_ADDR_LEN, key);
+static int write_line(int fd, hiddev_t *dev) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%s ", bd_addr_to_str(dev->addr));
+    len += snprintf(line + len, sizeof(line) - len, "%s", link_key_to_str(dev->key));
+    if (dev->opts[0])
+        len += snprintf(line + len, sizeof(line) - len, " %s", dev->opts);
+    len += snprintf(line + len, sizeof(line) - len, "\n");
+    return write(fd, line, len) < len;
+}
 
-    if (!remove || !found) {
-        close(fd);
-        return !!found;
+// our own writes shouldn't cause a reload
+static void note_written(void) {
+    struct stat st;
+    if (stat(hiddevs_db_file, &st) == 0) {
+        loaded = 1;
+        loaded_mtime = st.st_mtim;
     }
+}
 
-    int ret = 0;
+int hiddevs_add(bd_addr_t addr, link_key_t key) {
+    if (hiddevs_is_hid(addr))
+        return 0;
 
-    lseek(fd, 0, SEEK_SET);
-    if (write(fd, buf, found - buf) < 0)
-        printf("ERROR - couldn't write to " HIDDEVS_FILE "\n");
-    while (*found++ != '\n');
-    if (write(fd, found, strlen(found)) < 0)
-        printf("ERROR - couldn't write to " HIDDEVS_FILE "\n");
+    // contains link keys, so keep secret
+    int fd = open(hiddevs_db_file, O_WRONLY|O_CREAT|O_APPEND, 0600);
+    if (fd < 0) {
+        printf("WARNING - could not open %s for writing\n", hiddevs_db_file);
+        return 1;
+    }
+    int ret = write_line(fd, append(addr, key));
     close(fd);
-
-    return 1;
+    note_written();
+    return ret;
 }
 
 int hiddevs_is_hid(bd_addr_t addr) {
-    return check_and_remove(addr, 0, NULL);
+    return find(addr) != NULL;
 }
 
 int hiddevs_read_link_key(bd_addr_t addr, link_key_t key) {
-    return check_and_remove(addr, 0, key);
+    hiddev_t *dev = find(addr);
+    if (!dev)
+        return 0;
+    memcpy(key, dev->key, LINK_KEY_LEN);
+    return 1;
 }
 
-int hiddevs_remove(bd_addr_t addr) {
-    return check_and_remove(addr, 1, NULL);
+int hiddevs_read_link(bd_addr_t addr, hiddevs_link_t *link) {
+    hiddev_t *dev = find(addr);
+    if (!dev)
+        return 0;
+    *link = dev->link;
+    return 1;
 }
 
-void hiddevs_forall(void (*process)(bd_addr_t)) {
-    int fd = open(HIDDEVS_FILE, O_RDONLY);
-    if (fd < 0) {
-        // printf("WARNING - could not open " HIDDEVS_FILE "\n");
+// largest MTU asked for by any device, or 0
+uint16_t hiddevs_max_mtu(void) {
+    uint16_t mtu = 0;
+    int i;
+    load();
+    for (i=0; i<ndevs; i++)
+        if (devs[i].link.mtu > mtu)
+            mtu = devs[i].link.mtu;
+    return mtu;
+}
+
+// whether a line of the file is for this device
+static int line_is_for(char *line, int len, bd_addr_t addr) {
+    char p[18];
+    bd_addr_t line_addr;
+    while (len && (*line == ' ' || *line == '\t')) {
+        line++;
+        len--;
     }
+    if (len < 17 || (len > 17 && line[17] != ' ' && line[17] != '\t' && line[17] != '\n'))
+        return 0;
+    memcpy(p, line, 17);
+    p[17] = '\0';
+    return sscan_bd_addr((uint8_t *)p, line_addr) && !BD_ADDR_CMP(line_addr, addr);
+}
+
+// the file is rewritten from what is on disk rather than from the cache, so
+// that comments and lines we couldn't parse are kept as they were written
+int hiddevs_remove(bd_addr_t addr) {
+    hiddev_t *dev = find(addr);
+    if (!dev)
+        return 0;
+    ndevs--;
+    memmove(dev, dev + 1, (devs + ndevs - dev) * sizeof(hiddev_t));
 
-    char buf[4096], *p;
-    int n = read(fd, buf, sizeof(buf));
-    if (n == sizeof(buf)) {
-        printf("WARNING - hiddevs file is ridiculously big, will be truncated\n");
-        n--;
+    struct stat st;
+    char *buf = NULL;
+    int fd = open(hiddevs_db_file, O_RDWR);
+    if (fd < 0 || fstat(fd, &st) < 0 || !(buf = malloc(st.st_size + 1)) ||
+        read(fd, buf, st.st_size) != st.st_size) {
+        printf("ERROR - couldn't read %s\n", hiddevs_db_file);
+        goto done;
     }
-    buf[n] = '\0';
-    close(fd);
 
-    bd_addr_t addr;
-    char *pbuf = buf;
-    while (p = strtok(pbuf, " ")) {
-        pbuf = 0;
-
-        if (strlen(p) != 17 ||
-            !sscan_bd_addr(p, addr)) {
-            printf("Malformatted line in %s: \"%s\"\n", HIDDEVS_FILE, p);
-            return;
+    char *p = buf, *end = buf + st.st_size, *out = buf;
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        int len = nl ? nl + 1 - p : end - p;
+        if (!line_is_for(p, len, addr)) {
+            memmove(out, p, len);
+            out += len;
         }
-        process(addr);
+        p += len;
+    }
+    if (lseek(fd, 0, SEEK_SET) < 0 || write(fd, buf, out - buf) != out - buf ||
+        ftruncate(fd, out - buf) < 0)
+        printf("ERROR - couldn't write to %s\n", hiddevs_db_file);
+
+done:
+    free(buf);
+    if (fd >= 0)
+        close(fd);
+    note_written();
+    return 1;
+}
 
-        // skip key
-        p = strtok(NULL, "\n");
+void hiddevs_forall(void (*process)(bd_addr_t)) {
+    int i;
+    load();
+    // process may add or remove devices, so copy each address out first
+    for (i=0; i<ndevs; i++) {
+        bd_addr_t addr;
+        BD_ADDR_COPY(addr, devs[i].addr);
+        process(addr);
     }
 }
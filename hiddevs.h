@@ -1,6 +1,21 @@
+// L2CAP MTU limits: the minimum L2CAP allows, and the HIDP header plus the
+// largest report uhid can carry
+#define HIDDEVS_MIN_MTU 48
+#define HIDDEVS_MAX_MTU (1 + 4096)
+
+// per-device L2CAP settings. 0 means the default
+typedef struct {
+    uint16_t mtu;
+    uint16_t flush_ms;
+    // class of device implied by class=, for devices we connect out to. 0 if none
+    uint32_t cod;
+} hiddevs_link_t;
+
 int hiddevs_remove(bd_addr_t addr);
 int hiddevs_add(bd_addr_t addr, link_key_t key);
 int hiddevs_is_hid(bd_addr_t addr);
 int hiddevs_read_link_key(bd_addr_t addr, link_key_t key);
+int hiddevs_read_link(bd_addr_t addr, hiddevs_link_t *link);
+uint16_t hiddevs_max_mtu(void);
 void hiddevs_forall(void (*process)(bd_addr_t));
 extern const char *hiddevs_db_file;
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <btstack/btstack.h>
+#include <btstack/utils.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/linked_list.h>
+#include "bthid.h"
+#include "linkstats.h"
+#include "hcicmd.h"
+
+// periodically read RSSI, link quality and failed contact counter for each
+// active link, and warn about links that look like they're about to drop.
+// links which haven't sent a report since the last poll aren't polled, and
+// healthy links are polled less and less often.
+
+#ifndef OGF_STATUS_PARAMETERS
+#define OGF_STATUS_PARAMETERS 0x05
+#endif
+static const hci_cmd_t read_failed_contact_counter = { OPCODE(OGF_STATUS_PARAMETERS, 0x01), "H" };
+static const hci_cmd_t read_link_quality = { OPCODE(OGF_STATUS_PARAMETERS, 0x03), "H" };
+static const hci_cmd_t read_rssi = { OPCODE(OGF_STATUS_PARAMETERS, 0x05), "H" };
+
+#define TICK_MS         1000
+#define POLL_MIN_MS     1000
+#define POLL_MAX_MS     16000
+
+// thresholds for calling a link degraded. RSSI is relative to the golden
+// receive power range, so 0 is fine and negative is weak
+#define RSSI_WARN       -8
+#define QUALITY_WARN    200
+#define FAILED_WARN     1
+
+int linkstats_verbose = 0;
+
+static timer_source_t timer;
+static int timer_armed = 0;
+
+static void print_stats(bthid_dev_t *dev) {
+    bthid_link_stats_t *st = &dev->stats;
+    printf("stats %s in=%u out=%u rate=%d rssi=%d quality=%u failed=%u degraded=%d\n",
+           bd_addr_to_str(dev->addr), st->reports_in, st->reports_out, st->rate,
+           st->rssi_avg / 16, st->quality_avg / 16, st->failed_contacts, st->degraded);
+}
+
+static void check_degraded(bthid_dev_t *dev) {
+    bthid_link_stats_t *st = &dev->stats;
+    int degraded = st->rssi_avg < RSSI_WARN * 16 ||
+                   st->quality_avg < QUALITY_WARN * 16 ||
+                   st->failed_contacts >= FAILED_WARN;
+
+    if (degraded && !st->degraded)
+        printf("WARNING: link to %s is degrading (rssi %d, quality %u, failed contacts %u)\n",
+               bd_addr_to_str(dev->addr), st->rssi, st->quality, st->failed_contacts);
+    else if (!degraded && st->degraded)
+        printf("Link to %s has recovered\n", bd_addr_to_str(dev->addr));
+    st->degraded = degraded;
+}
+
+static void poll(bthid_dev_t *dev, uint32_t now) {
+    bthid_link_stats_t *st = &dev->stats;
+    uint32_t elapsed = now - st->last_poll_ms;
+
+    st->rate = elapsed ? (st->reports_in - st->last_reports_in) * 1000 / elapsed : 0;
+    st->last_poll_ms = now;
+
+    if (st->reports_in == st->last_reports_in) {
+        // idle: nothing to measure, and nobody to notice lag
+        st->interval_ms = POLL_MIN_MS;
+        st->next_poll_ms = now + st->interval_ms;
+        return;
+    }
+    st->last_reports_in = st->reports_in;
+
+    hcicmd_send(HCICMD_BACKGROUND, &read_rssi, dev->handle);
+    hcicmd_send(HCICMD_BACKGROUND, &read_link_quality, dev->handle);
+    hcicmd_send(HCICMD_BACKGROUND, &read_failed_contact_counter, dev->handle);
+
+    if (st->degraded)
+        st->interval_ms = POLL_MIN_MS;
+    else if (st->interval_ms < POLL_MAX_MS)
+        st->interval_ms *= 2;
+    st->next_poll_ms = now + st->interval_ms;
+
+    if (linkstats_verbose)
+        print_stats(dev);
+}
+
+static void tick(timer_source_t *ts) {
+    uint32_t now = bthid_now_ms();
+    int active = 0;
+
+    linked_list_iterator_t it;
+    linked_list_iterator_init(&it, &bthid_devs);
+    while (linked_list_iterator_has_next(&it)) {
+        bthid_dev_t *dev = (bthid_dev_t *)linked_list_iterator_next(&it);
+        if (!dev->handle)
+            continue;
+        active = 1;
+        if (!dev->stats.interval_ms) {  // new link
+            dev->stats.interval_ms = POLL_MIN_MS;
+            dev->stats.last_poll_ms = now;
+            dev->stats.next_poll_ms = now + POLL_MIN_MS;
+            continue;
+        }
+        if ((int32_t)(now - dev->stats.next_poll_ms) >= 0)
+            poll(dev, now);
+    }
+
+    timer_armed = active;
+    if (active) {
+        run_loop_set_timer(&timer, TICK_MS);
+        run_loop_add_timer(&timer);
+    }
+}
+
+// called when a link comes up; the timer stops itself when none are left
+void linkstats_start(void) {
+    if (timer_armed)
+        return;
+    timer_armed = 1;
+    timer.process = tick;
+    run_loop_set_timer(&timer, TICK_MS);
+    run_loop_add_timer(&timer);
+}
+
+static void update_avg(int *avg, int value, int samples) {
+    if (!samples)
+        *avg = value * 16;
+    else
+        *avg += value * 2 - *avg / 8;   // 1/8 weight to each new sample
+}
+
+// feed HCI events through here to collect results
+void linkstats_event(uint8_t *packet, int size) {
+    if (packet[0] != HCI_EVENT_COMMAND_COMPLETE || size < 9)
+        return;
+
+    uint16_t opcode = READ_BT_16(packet, 3);
+    if (opcode != read_rssi.opcode &&
+        opcode != read_link_quality.opcode &&
+        opcode != read_failed_contact_counter.opcode)
+        return;
+    if (packet[5])  // failed
+        return;
+
+    bthid_dev_t *dev = bthid_dev_for_handle(READ_BT_16(packet, 6));
+    if (!dev)
+        return;
+    bthid_link_stats_t *st = &dev->stats;
+
+    if (opcode == read_rssi.opcode) {
+        st->rssi = (int8_t)packet[8];
+        update_avg(&st->rssi_avg, st->rssi, st->samples);
+    } else if (opcode == read_link_quality.opcode) {
+        st->quality = packet[8];
+        update_avg(&st->quality_avg, st->quality, st->samples);
+    } else {
+        if (size < 10)
+            return;
+        // read last, so the sample is complete
+        st->failed_contacts = READ_BT_16(packet, 8);
+        st->samples++;
+        check_degraded(dev);
+    }
+}
@@ -0,0 +1,5 @@
+// print per-device statistics at every poll
+extern int linkstats_verbose;
+
+void linkstats_start(void);
+void linkstats_event(uint8_t *packet, int size);
@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/utils.h>
+#include "remap.h"
+
+// XXX should make this a command-line option
+#define REMAP_FILE "hidremap"
+
+// report descriptor parsing {{{
+#define MAX_FIELDS  64
+#define MAX_USAGES  16
+
+typedef struct {
+    uint8_t report_id;
+    uint16_t bit;           // offset of first element, after any report ID
+    uint8_t size, count;
+    int array;
+    int32_t logical_min;
+    // either a range, or a list of usages
+    uint32_t usage_min, usage_max;
+    uint32_t usages[MAX_USAGES];
+    int nusages;
+} field_t;
+
+typedef struct {
+    uint16_t page;
+    int32_t logical_min;
+    uint8_t size, count, report_id;
+} globals_t;
+
+static uint32_t item_data(uint8_t *p, int len) {
+    uint32_t v = 0;
+    while (len--)
+        v = (v << 8) | p[len];
+    return v;
+}
+static int32_t item_sdata(uint8_t *p, int len) {
+    uint32_t v = item_data(p, len);
+    if (len == 1)
+        return (int8_t)v;
+    if (len == 2)
+        return (int16_t)v;
+    return v;
+}
+// local usages of 1 or 2 bytes take the current usage page
+static uint32_t full_usage(globals_t *g, uint32_t v, int len) {
+    return len == 4 ? v : ((uint32_t)g->page << 16) | v;
+}
+
+// returns number of input fields found, into fields unless it is NULL.
+// *has_ids is set if reports are numbered
+static int parse_descriptor(uint8_t *desc, int len, field_t *fields, int *has_ids) {
+    globals_t g, stack[4];
+    int sp = 0, nfields = 0;
+    uint16_t offsets[256];
+    uint32_t usage_min = 0, usage_max = 0, usages[MAX_USAGES];
+    int nusages = 0;
+
+    memset(&g, 0, sizeof(g));
+    memset(offsets, 0, sizeof(offsets));
+    *has_ids = 0;
+
+    while (len > 0) {
+        uint8_t prefix = desc[0];
+        if (prefix == 0xFE) {   // long item
+            if (len < 3)
+                break;
+            len  -= 3 + desc[1];
+            desc += 3 + desc[1];
+            continue;
+        }
+        int size = prefix & 3;
+        if (size == 3)
+            size = 4;
+        if (1 + size > len)
+            break;
+        uint8_t *data = desc + 1;
+        uint32_t v = item_data(data, size);
+
+        switch (prefix & 0xFC) {
+            // global
+            case 0x04: g.page = v; break;
+            case 0x14: g.logical_min = item_sdata(data, size); break;
+            case 0x74: g.size = v; break;
+            case 0x84: g.report_id = v; *has_ids = 1; break;
+            case 0x94: g.count = v; break;
+            case 0xA4:
+                if (sp < 4)
+                    stack[sp++] = g;
+                break;
+            case 0xB4:
+                if (sp > 0)
+                    g = stack[--sp];
+                break;
+
+            // local
+            case 0x08:
+                if (nusages < MAX_USAGES)
+                    usages[nusages++] = full_usage(&g, v, size);
+                break;
+            case 0x18: usage_min = full_usage(&g, v, size); break;
+            case 0x28: usage_max = full_usage(&g, v, size); break;
+
+            // main
+            case 0x80:  // input
+                if (fields && !(v & 1) && nfields < MAX_FIELDS) {   // skip constants
+                    field_t *f = &fields[nfields++];
+                    f->report_id = g.report_id;
+                    f->bit = offsets[g.report_id];
+                    f->size = g.size;
+                    f->count = g.count;
+                    f->array = !(v & 2);
+                    f->logical_min = g.logical_min;
+                    f->usage_min = usage_min;
+                    f->usage_max = usage_max;
+                    memcpy(f->usages, usages, sizeof(usages));
+                    f->nusages = nusages;
+                }
+                offsets[g.report_id] += g.size * g.count;
+                // fall through
+            case 0x90:  // output
+            case 0xB0:  // feature
+            case 0xA0:  // collection
+            case 0xC0:  // end collection
+                usage_min = usage_max = 0;
+                nusages = 0;
+                break;
+        }
+
+        len  -= 1 + size;
+        desc += 1 + size;
+    }
+    return nfields;
+}
+// }}}
+
+// compiling rules into tables {{{
+typedef struct {
+    uint8_t report_id;
+    uint8_t kind;
+    int field;          // REMAP_ARRAY: index into fields
+    uint16_t pos;
+} location_t;
+
+static int find_usage(field_t *fields, int nfields, uint32_t usage, location_t *loc) {
+    int i, j;
+    for (i=0; i<nfields; i++) {
+        field_t *f = &fields[i];
+        loc->report_id = f->report_id;
+        loc->field = i;
+
+        if (f->array) {
+            if (f->size != 8 || f->bit % 8 ||
+                usage < f->usage_min || usage > f->usage_max)
+                continue;
+            int value = f->logical_min + (usage - f->usage_min);
+            if (value < 0 || value > 255)
+                continue;
+            loc->kind = REMAP_ARRAY;
+            loc->pos = value;
+            return 1;
+        }
+
+        if (f->size != 1)
+            continue;
+        for (j=0; j<f->count; j++) {
+            uint32_t u;
+            if (f->nusages)
+                u = f->usages[j < f->nusages ? j : f->nusages - 1];
+            else
+                u = f->usage_min + j;
+            if (u == usage) {
+                loc->kind = REMAP_BIT;
+                loc->pos = f->bit + j;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// index into r->arrays for a descriptor field, adding it if needed
+static int array_for(remap_t *r, field_t *fields, int field, int *map) {
+    if (map[field] >= 0)
+        return map[field];
+    if (r->narrays == REMAP_MAX_ARRAYS)
+        return -1;
+    remap_array_t *a = &r->arrays[r->narrays];
+    memset(a, 0, sizeof(*a));
+    a->report_id = fields[field].report_id;
+    a->offset = fields[field].bit / 8;
+    a->count = fields[field].count;
+    return map[field] = r->narrays++;
+}
+
+static uint32_t parse_usage(char *s) {
+    char *id = strchr(s, ':');
+    if (!id)
+        return strtoul(s, NULL, 16);
+    return (strtoul(s, NULL, 16) << 16) | strtoul(id + 1, NULL, 16);
+}
+
+// wildcard rules quietly skip devices they don't fit
+static void add_rule(remap_t *r, field_t *fields, int nfields, int *map,
+                     uint32_t from, uint32_t to, int quiet) {
+    location_t src, dst;
+    remap_target_t target;
+
+    if (!find_usage(fields, nfields, from, &src)) {
+        if (!quiet)
+            printf("WARNING: remap: usage %X not in descriptor\n", from);
+        return;
+    }
+    target.kind = REMAP_NONE;
+    target.array = 0;
+    target.pos = 0;
+    if (to) {
+        if (!find_usage(fields, nfields, to, &dst)) {
+            if (!quiet)
+                printf("WARNING: remap: usage %X not in descriptor\n", to);
+            return;
+        }
+        if (dst.report_id != src.report_id) {
+            if (!quiet)
+                printf("WARNING: remap: usages %X and %X are in different reports\n", from, to);
+            return;
+        }
+        target.kind = dst.kind;
+        target.pos = dst.pos;
+        if (dst.kind == REMAP_ARRAY) {
+            int a = array_for(r, fields, dst.field, map);
+            if (a < 0)
+                return;
+            target.array = a;
+        }
+    }
+
+    if (src.kind == REMAP_BIT) {
+        if (r->nbits == REMAP_MAX_RULES)
+            return;
+        remap_bit_t *b = &r->bits[r->nbits++];
+        b->report_id = src.report_id;
+        b->bit = src.pos;
+        b->dst = target;
+    } else {
+        int a = array_for(r, fields, src.field, map);
+        if (a < 0 || r->ntargets == REMAP_MAX_RULES)
+            return;
+        r->targets[r->ntargets] = target;
+        r->arrays[a].rule[src.pos] = ++r->ntargets;
+    }
+}
+
+// rules are read from REMAP_FILE, one per line:
+//   <address or *> <page:usage> <page:usage, or 0 to disable>
+// with usages in hex, eg. "* 7:39 7:e0" turns caps lock into left control.
+// the file is read once at startup, so connecting allocates nothing
+#define MAX_FILE_RULES 64
+
+static struct {
+    int any;            // "*": for every device
+    bd_addr_t addr;
+    uint32_t from, to;
+} rules[MAX_FILE_RULES];
+static int nrules = 0;
+
+int remap_has_ids(uint8_t *descriptor, int descriptor_len) {
+    int has_ids;
+    parse_descriptor(descriptor, descriptor_len, NULL, &has_ids);
+    return has_ids;
+}
+
+void remap_load(void) {
+    FILE *f = fopen(REMAP_FILE, "r");
+    if (!f)
+        return;
+
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        char *who = strtok(line, " \t\n");
+        char *from = strtok(NULL, " \t\n");
+        char *to = strtok(NULL, " \t\n");
+        if (!who || who[0] == '#')
+            continue;
+        if (!from || !to) {
+            printf("Malformatted line in %s: \"%s\"\n", REMAP_FILE, who);
+            continue;
+        }
+        if (nrules == MAX_FILE_RULES) {
+            printf("WARNING: too many rules in %s, ignoring the rest\n", REMAP_FILE);
+            break;
+        }
+        rules[nrules].any = !strcmp(who, "*");
+        if (!rules[nrules].any &&
+            (strlen(who) != 17 || !sscan_bd_addr((uint8_t *)who, rules[nrules].addr))) {
+            printf("Malformatted line in %s: \"%s\"\n", REMAP_FILE, who);
+            continue;
+        }
+        rules[nrules].from = parse_usage(from);
+        rules[nrules].to = parse_usage(to);
+        nrules++;
+    }
+    fclose(f);
+}
+
+remap_t * remap_compile(bd_addr_t addr, uint8_t *descriptor, int descriptor_len, remap_t *buf) {
+    if (!nrules)
+        return NULL;
+
+    field_t fields[MAX_FIELDS];
+    int map[MAX_FIELDS], i, has_ids;
+    int nfields = parse_descriptor(descriptor, descriptor_len, fields, &has_ids);
+    for (i=0; i<MAX_FIELDS; i++)
+        map[i] = -1;
+
+    memset(buf, 0, sizeof(*buf));
+    buf->has_ids = has_ids;
+
+    for (i=0; i<nrules; i++) {
+        if (!rules[i].any && BD_ADDR_CMP(rules[i].addr, addr))
+            continue;
+        add_rule(buf, fields, nfields, map, rules[i].from, rules[i].to, rules[i].any);
+    }
+
+    if (!buf->nbits && !buf->narrays)
+        return NULL;
+    printf("Remapping %d usages\n", buf->nbits + buf->ntargets);
+    return buf;
+}
+// }}}
+
+// rewriting reports in place {{{
+#define MAX_PENDING 64
+
+void remap_report(remap_t *r, uint8_t *report, int size) {
+    remap_target_t *pending[MAX_PENDING];
+    uint8_t src[REMAP_MAX_RULES];
+    int npending = 0, i, j;
+    uint8_t id = 0;
+
+    if (r->has_ids) {
+        if (size < 1)
+            return;
+        id = report[0];
+        report++;
+        size--;
+    }
+
+    // sample every remapped bit before anything moves
+    for (i=0; i<r->nbits; i++) {
+        remap_bit_t *b = &r->bits[i];
+        src[i] = 0;
+        if (b->report_id == id && b->bit / 8 < size)
+            src[i] = (report[b->bit / 8] >> (b->bit % 8)) & 1;
+    }
+
+    for (i=0; i<r->narrays; i++) {
+        remap_array_t *a = &r->arrays[i];
+        if (a->report_id != id || a->offset + a->count > size)
+            continue;
+        for (j=0; j<a->count; j++) {
+            uint8_t *v = &report[a->offset + j];
+            if (!a->rule[*v])
+                continue;
+            remap_target_t *t = &r->targets[a->rule[*v] - 1];
+            if (t->kind == REMAP_ARRAY && t->array == i) {
+                *v = t->pos;
+                continue;
+            }
+            *v = 0;
+            if (t->kind != REMAP_NONE && npending < MAX_PENDING)
+                pending[npending++] = t;
+        }
+    }
+
+    for (i=0; i<r->nbits; i++) {
+        remap_bit_t *b = &r->bits[i];
+        if (b->report_id != id || b->bit / 8 >= size)
+            continue;
+        report[b->bit / 8] &= ~(1 << (b->bit % 8));
+        if (src[i] && b->dst.kind != REMAP_NONE && npending < MAX_PENDING)
+            pending[npending++] = &b->dst;
+    }
+
+    for (i=0; i<npending; i++) {
+        remap_target_t *t = pending[i];
+        if (t->kind == REMAP_BIT) {
+            if (t->pos / 8 < size)
+                report[t->pos / 8] |= 1 << (t->pos % 8);
+            continue;
+        }
+        // into the first free slot of the array
+        remap_array_t *a = &r->arrays[t->array];
+        if (a->offset + a->count > size)
+            continue;
+        for (j=0; j<a->count; j++) {
+            if (!report[a->offset + j]) {
+                report[a->offset + j] = t->pos;
+                break;
+            }
+        }
+    }
+}
+// }}}
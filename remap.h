@@ -0,0 +1,43 @@
+// key and button remapping, compiled against a device's report descriptor
+
+#define REMAP_MAX_RULES     32
+#define REMAP_MAX_ARRAYS    4
+
+#define REMAP_NONE          0   // usage is dropped
+#define REMAP_BIT           1   // a 1-bit variable field, eg. a button or modifier
+#define REMAP_ARRAY         2   // a value in an 8-bit array field, eg. a key
+
+typedef struct {
+    uint8_t kind;
+    uint8_t array;      // REMAP_ARRAY: index into remap_t arrays
+    uint16_t pos;       // REMAP_BIT: bit offset. REMAP_ARRAY: value
+} remap_target_t;
+
+typedef struct {
+    uint8_t report_id;
+    uint16_t bit;
+    remap_target_t dst;
+} remap_bit_t;
+
+typedef struct {
+    uint8_t report_id;
+    uint16_t offset;    // byte offset of first element
+    uint8_t count;
+    uint8_t rule[256];  // per value: 0 to leave alone, else index+1 into targets
+} remap_array_t;
+
+typedef struct {
+    int has_ids;
+    int nbits, narrays, ntargets;
+    remap_bit_t bits[REMAP_MAX_RULES];
+    remap_array_t arrays[REMAP_MAX_ARRAYS];
+    remap_target_t targets[REMAP_MAX_RULES];
+} remap_t;
+
+// whether reports start with a report ID
+int remap_has_ids(uint8_t *descriptor, int descriptor_len);
+// read the rules file; once, at startup
+void remap_load(void);
+// returns buf, or NULL if no rules apply to this device
+remap_t * remap_compile(bd_addr_t addr, uint8_t *descriptor, int descriptor_len, remap_t *buf);
+void remap_report(remap_t *r, uint8_t *report, int size);
@@ -0,0 +1,688 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <btstack/btstack.h>
+#include <btstack/utils.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/linked_list.h>
+#include <btstack/run_loop.h>
+#include <btstack/sdp_util.h>
+#include "standin.h"
+
+// modelled delays, in us. roughly what a USB controller and a nearby HID
+// device manage; only their relative sizes matter much
+#define CMD_US          500     // command status or complete
+#define ACL_US          20000   // page to connection complete
+#define AUTH_US         5000    // link key reply to authenticated
+#define L2CAP_US        3000    // channel request to open
+#define NAME_US         30000   // remote name request
+#define SDP_US          40000   // SDP query, including its channel
+#define HANDSHAKE_US    2000    // SET_PROTOCOL to HANDSHAKE
+#define OUT_US          1250    // output report, one slot pair
+
+#define INITIAL_CREDITS 2
+#define DEFAULT_MTU     672     // L2CAP's, if no service has been registered
+
+#ifndef OGF_STATUS_PARAMETERS
+#define OGF_STATUS_PARAMETERS 0x05
+#endif
+
+// device attributes handed out over SDP: a three-button mouse
+static uint8_t descriptor[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+    0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7F,
+    0x75, 0x08, 0x95, 0x02, 0x81, 0x06, 0xC0, 0xC0,
+};
+#define VENDOR_ID   0x1234
+#define PRODUCT_ID  0x5678
+#define VERSION     0x0100
+
+enum {
+    EV_CONN_REQUEST,
+    EV_CONN_COMPLETE,
+    EV_LINK_KEY_REQUEST,
+    EV_INCOMING,        // arg: PSM
+    EV_OPENED,          // arg: PSM
+    EV_CREDITS,         // arg: credits
+    EV_CMD_STATUS,      // arg: opcode
+    EV_CMD_COMPLETE,    // arg: opcode
+    EV_NAME,
+    EV_SDP,             // arg: first attribute asked for
+    EV_HANDSHAKE,
+    EV_REPORT,          // the device has a report to send
+    EV_RECEIVED,        // which has got through to us
+    EV_SENT,            // arg: STANDIN_* fate of an output report
+    EV_DISCONNECT,
+};
+
+typedef struct {
+    uint64_t t;
+    uint32_t seq;       // keeps events due together in order
+    int dev;            // -1 if not for a device
+    uint16_t gen;
+    uint8_t kind;
+    uint16_t arg;
+    // reports: when they were sent
+    uint64_t since;
+    // command complete: the command's first parameters, echoed back.
+    // output reports: their first bytes
+    uint8_t data[8];
+} event_t;
+
+typedef struct {
+    bd_addr_t addr;
+    uint32_t cod;
+    int connected;
+    // bumped on disconnect, so events from the old link are dropped
+    uint16_t gen;
+    uint16_t cid_control, cid_interrupt;
+
+    uint8_t *report;
+    int report_len, reports_left;
+    uint32_t period;
+
+    // interrupt channel MTU we gave the device, and our flush timeout
+    uint16_t mtu;
+    uint32_t flush_us;
+    // when each direction of the radio link is next free, and reports
+    // waiting in the device's controller
+    uint64_t in_busy, out_busy;
+    int in_queued;
+} sdev_t;
+
+uint64_t standin_now = 0;
+void (*standin_event_hook)(int n) = NULL;
+void (*standin_report_hook)(int n, int out, uint64_t sent, uint8_t *data, int fate) = NULL;
+int standin_radio = 0;
+int standin_loss_pct = 0;
+
+static btstack_packet_handler_t handler = NULL;
+static sdev_t *sdevs;
+static int nsdevs;
+
+// pending events, as a binary heap on (t, seq)
+static event_t *events;
+static int nevents, maxevents;
+static uint32_t next_seq = 0;
+
+static linked_list_t timers = NULL;
+static uint16_t service_mtu = DEFAULT_MTU;
+
+// event queue {{{
+static int before(event_t *a, event_t *b) {
+    if (a->t != b->t)
+        return a->t < b->t;
+    return (int32_t)(a->seq - b->seq) < 0;
+}
+
+// returns the new event, valid until the queue next changes
+static event_t * schedule(uint64_t t, int dev, uint8_t kind, uint16_t arg) {
+    if (nevents == maxevents) {
+        printf("ERROR: stand-in event queue full\n");
+        exit(1);
+    }
+    event_t ev = { t, next_seq++, dev, dev >= 0 ? sdevs[dev].gen : 0, kind, arg, 0 };
+    int i = nevents++;
+    while (i > 0 && before(&ev, &events[(i - 1) / 2])) {
+        events[i] = events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    events[i] = ev;
+    return &events[i];
+}
+
+// completion echoes the handle or address a command is for
+static void schedule_complete(uint16_t opcode, uint8_t *cmd) {
+    event_t *ev = schedule(standin_now + CMD_US, -1, EV_CMD_COMPLETE, opcode);
+    memcpy(ev->data, cmd + 3, BD_ADDR_LEN);
+}
+
+static event_t pop(void) {
+    event_t top = events[0], last = events[--nevents];
+    int i = 0;
+    for (;;) {
+        int c = 2*i + 1;
+        if (c >= nevents)
+            break;
+        if (c + 1 < nevents && before(&events[c + 1], &events[c]))
+            c++;
+        if (!before(&events[c], &last))
+            break;
+        events[i] = events[c];
+        i = c;
+    }
+    events[i] = last;
+    return top;
+}
+// }}}
+
+void standin_init(int ndevs) {
+    int i;
+    nsdevs = ndevs;
+    sdevs = calloc(ndevs, sizeof(sdev_t));
+    maxevents = ndevs * 16 + 64;
+    events = malloc(maxevents * sizeof(event_t));
+    for (i=0; i<ndevs; i++) {
+        uint8_t addr[6] = { 0x00, 0x1B, 0xDC, i >> 16, i >> 8, i };
+        BD_ADDR_COPY(sdevs[i].addr, addr);
+        sdevs[i].cid_control = 0x40 + 2*i;
+        sdevs[i].cid_interrupt = 0x41 + 2*i;
+    }
+}
+
+void standin_addr(int n, bd_addr_t addr) {
+    BD_ADDR_COPY(addr, sdevs[n].addr);
+}
+
+void standin_connect(int n, uint64_t t, uint32_t cod) {
+    sdevs[n].cod = cod;
+    schedule(t, n, EV_CONN_REQUEST, 0);
+}
+
+void standin_disconnect(int n, uint64_t t) {
+    schedule(t, n, EV_DISCONNECT, 0);
+}
+
+void standin_stream(int n, uint64_t t, uint32_t period, int count, uint8_t *report, int len) {
+    sdev_t *s = &sdevs[n];
+    s->report = report;
+    s->report_len = len;
+    s->period = period;
+    s->reports_left = count;
+    if (count)
+        schedule(t, n, EV_REPORT, 0);
+}
+
+static int sdev_for_addr(bd_addr_t addr) {
+    int i;
+    for (i=0; i<nsdevs; i++)
+        if (!BD_ADDR_CMP(sdevs[i].addr, addr))
+            return i;
+    return -1;
+}
+static int sdev_for_cid(uint16_t cid) {
+    int n = (cid - 0x40) / 2;
+    return cid >= 0x40 && n < nsdevs ? n : -1;
+}
+// ACL handles are just device number + 1
+static int sdev_for_handle(uint16_t handle) {
+    return handle >= 1 && handle <= nsdevs ? handle - 1 : -1;
+}
+
+// the radio link {{{
+// each direction of a link carries one L2CAP frame at a time, in baseband
+// packets of up to 339 bytes (DH5), each repeated until it gets through.
+// links don't compete for airtime; this is for measuring tinyhidd, not
+// the piconet
+#define SLOT_US         625
+#define L2CAP_HEADER    4
+#define DEVICE_QUEUE    4       // reports a device's controller can hold
+
+static uint32_t rng = 1;
+
+static int lost(void) {
+    rng = rng * 1103515245 + 12345;
+    return (rng >> 16) % 100 < standin_loss_pct;
+}
+
+// a DH1, DH3 or DH5 packet and the slot for the reply
+static int packet_slots(int len) {
+    return len <= 27 ? 2 : len <= 183 ? 4 : 6;
+}
+
+// send len bytes, queued at time t, over a link direction which is free
+// from *busy. returns when the frame got through, or 0 if the flush
+// timeout (flush_us, 0 for none) ran out first. *busy moves on past it
+static uint64_t transmit(uint64_t *busy, uint64_t t, int len, uint32_t flush_us) {
+    uint64_t start = *busy > t ? *busy : t, at = start;
+    int left = len + L2CAP_HEADER;
+    while (left > 0) {
+        int n = left > 339 ? 339 : left;
+        if (flush_us && at - start >= flush_us) {
+            *busy = at;
+            return 0;
+        }
+        at += packet_slots(n) * SLOT_US;
+        if (!lost())
+            left -= n;
+    }
+    *busy = at;
+    return at;
+}
+
+static void report_fate(int n, int out, uint64_t sent, uint8_t *data, int fate) {
+    if (standin_report_hook)
+        standin_report_hook(n, out, sent, data, fate);
+}
+// }}}
+
+// delivering events {{{
+static void deliver(uint8_t type, uint16_t channel, uint8_t *packet, int len) {
+    if (handler)
+        handler(type, channel, packet, len);
+}
+
+// an attribute value event: type, 2 unused, attribute id, value length,
+// then the value as a data element
+#define SDP_ATTR_HEADER 7
+// the descriptor list's data element headers: DES { DES { UINT8 0x22,
+// STRING descriptor } }, each DES and the string with a 16-bit length
+#define DESC_LIST_HEADER    (3 + 3 + 2 + 3)
+
+static void send_sdp_attrs(sdev_t *s, uint16_t first) {
+    uint8_t packet[SDP_ATTR_HEADER + DESC_LIST_HEADER + sizeof(descriptor)];
+    int len;
+
+    if (first == 0x0206) {
+        uint8_t *de = packet + SDP_ATTR_HEADER;
+        len = DESC_LIST_HEADER + sizeof(descriptor);
+        de[0] = 0x36;
+        net_store_16(de, 1, len - 3);
+        de[3] = 0x36;
+        net_store_16(de, 4, len - 6);
+        de[6] = 0x08;
+        de[7] = 0x22;
+        de[8] = 0x26;
+        net_store_16(de, 9, sizeof(descriptor));
+        memcpy(de + DESC_LIST_HEADER, descriptor, sizeof(descriptor));
+        packet[0] = SDP_CLIENT_PACKET;
+        bt_store_16(packet, 3, 0x0206);
+        bt_store_16(packet, 5, len);
+        deliver(SDP_CLIENT_PACKET, 0, packet, SDP_ATTR_HEADER + len);
+        return;
+    }
+
+    uint16_t values[3] = { VENDOR_ID, PRODUCT_ID, VERSION };
+    int i;
+    for (i=0; i<3; i++) {
+        packet[0] = SDP_CLIENT_PACKET;
+        bt_store_16(packet, 3, 0x0201 + i);
+        bt_store_16(packet, 5, 3);
+        packet[SDP_ATTR_HEADER] = 0x09;   // UINT16
+        net_store_16(packet, SDP_ATTR_HEADER + 1, values[i]);
+        deliver(SDP_CLIENT_PACKET, 0, packet, SDP_ATTR_HEADER + 3);
+    }
+}
+
+static void run_event(event_t *ev) {
+    sdev_t *s = ev->dev >= 0 ? &sdevs[ev->dev] : NULL;
+    uint8_t packet[2 + 255];
+    uint16_t handle = ev->dev + 1;
+
+    // the link this was for has gone. the controller still answers
+    // commands, and BTstack still ends SDP queries
+    int stale = s && (ev->gen != s->gen || (!s->connected && ev->kind != EV_CONN_REQUEST));
+    if (stale && ev->kind != EV_CMD_STATUS && ev->kind != EV_CMD_COMPLETE &&
+        ev->kind != EV_NAME && ev->kind != EV_SDP)
+        return;
+
+    memset(packet, 0, sizeof(packet));
+    switch (ev->kind) {
+        case EV_CONN_REQUEST:
+            s->connected = 1;
+            s->mtu = DEFAULT_MTU;
+            s->flush_us = 0;
+            s->in_busy = s->out_busy = standin_now;
+            s->in_queued = 0;
+            packet[0] = HCI_EVENT_CONNECTION_REQUEST;
+            packet[1] = 10;
+            bt_flip_addr(&packet[2], s->addr);
+            packet[8] = s->cod;
+            packet[9] = s->cod >> 8;
+            packet[10] = s->cod >> 16;
+            packet[11] = 1;     // ACL
+            deliver(HCI_EVENT_PACKET, 0, packet, 12);
+            // BTstack accepts the connection itself
+            schedule(standin_now + ACL_US, ev->dev, EV_CONN_COMPLETE, 0);
+            break;
+
+        case EV_CONN_COMPLETE:
+            packet[0] = HCI_EVENT_CONNECTION_COMPLETE;
+            packet[1] = 11;
+            bt_store_16(packet, 3, handle);
+            bt_flip_addr(&packet[5], s->addr);
+            packet[11] = 1;
+            deliver(HCI_EVENT_PACKET, 0, packet, 13);
+            schedule(standin_now + CMD_US, ev->dev, EV_LINK_KEY_REQUEST, 0);
+            break;
+
+        case EV_LINK_KEY_REQUEST:
+            packet[0] = HCI_EVENT_LINK_KEY_REQUEST;
+            packet[1] = 6;
+            bt_flip_addr(&packet[2], s->addr);
+            deliver(HCI_EVENT_PACKET, 0, packet, 8);
+            break;
+
+        case EV_INCOMING:
+            packet[0] = L2CAP_EVENT_INCOMING_CONNECTION;
+            packet[1] = 14;
+            bt_flip_addr(&packet[2], s->addr);
+            bt_store_16(packet, 8, handle);
+            bt_store_16(packet, 10, ev->arg);
+            bt_store_16(packet, 12, ev->arg == PSM_HID_CONTROL ? s->cid_control : s->cid_interrupt);
+            deliver(HCI_EVENT_PACKET, 0, packet, 16);
+            break;
+
+        case EV_OPENED:
+            packet[0] = L2CAP_EVENT_CHANNEL_OPENED;
+            packet[1] = 19;
+            bt_flip_addr(&packet[3], s->addr);
+            bt_store_16(packet, 9, handle);
+            bt_store_16(packet, 11, ev->arg);
+            bt_store_16(packet, 13, ev->arg == PSM_HID_CONTROL ? s->cid_control : s->cid_interrupt);
+            // the service MTU is what we told the device it may send
+            if (ev->arg == PSM_HID_INTERRUPT)
+                s->mtu = service_mtu;
+            bt_store_16(packet, 17, s->mtu);
+            bt_store_16(packet, 19, s->mtu);
+            deliver(HCI_EVENT_PACKET, 0, packet, 21);
+            // the device opens the interrupt channel once control is up
+            if (ev->arg == PSM_HID_CONTROL)
+                schedule(standin_now + L2CAP_US, ev->dev, EV_INCOMING, PSM_HID_INTERRUPT);
+            else
+                schedule(standin_now + CMD_US, ev->dev, EV_CREDITS, INITIAL_CREDITS);
+            break;
+
+        case EV_CREDITS:
+            packet[0] = L2CAP_EVENT_CREDITS;
+            packet[1] = 3;
+            bt_store_16(packet, 2, s->cid_interrupt);
+            packet[4] = ev->arg;
+            deliver(HCI_EVENT_PACKET, 0, packet, 5);
+            break;
+
+        case EV_CMD_STATUS:
+            packet[0] = HCI_EVENT_COMMAND_STATUS;
+            packet[1] = 4;
+            packet[3] = 1;      // credits
+            bt_store_16(packet, 4, ev->arg);
+            deliver(HCI_EVENT_PACKET, 0, packet, 6);
+            break;
+
+        case EV_CMD_COMPLETE:
+            packet[0] = HCI_EVENT_COMMAND_COMPLETE;
+            packet[1] = 10;
+            packet[2] = 1;      // credits
+            bt_store_16(packet, 3, ev->arg);
+            memcpy(&packet[6], ev->data, BD_ADDR_LEN);
+            // handle-based reads: handle then value. RSSI 0 is ideal,
+            // link quality 255 is perfect
+            if (ev->arg >> 10 == OGF_STATUS_PARAMETERS)
+                packet[8] = (ev->arg & 0x3FF) == 0x03 ? 255 : 0;
+            deliver(HCI_EVENT_PACKET, 0, packet, 12);
+            break;
+
+        case EV_NAME:
+            packet[0] = HCI_EVENT_REMOTE_NAME_REQUEST_COMPLETE;
+            packet[1] = 255;
+            packet[2] = stale ? 0x04 : 0;   // page timeout
+            bt_flip_addr(&packet[3], s->addr);
+            if (!stale)
+                snprintf((char *)&packet[9], 248, "Stand-in mouse %d", ev->dev);
+            deliver(HCI_EVENT_PACKET, 0, packet, 2 + 255);
+            break;
+
+        case EV_SDP:
+            if (!stale)
+                send_sdp_attrs(s, ev->arg);
+            packet[0] = SDP_QUERY_COMPLETE;
+            packet[1] = 1;
+            deliver(HCI_EVENT_PACKET, 0, packet, 3);
+            break;
+
+        case EV_HANDSHAKE:
+            packet[0] = 0x00;   // HANDSHAKE, successful
+            deliver(L2CAP_DATA_PACKET, s->cid_control, packet, 1);
+            break;
+
+        case EV_REPORT:
+            if (--s->reports_left > 0)
+                schedule(ev->t + s->period, ev->dev, EV_REPORT, 0);
+            if (s->report_len > s->mtu) {
+                report_fate(ev->dev, 0, standin_now, s->report, STANDIN_TOO_LONG);
+            } else if (!standin_radio) {
+                deliver(L2CAP_DATA_PACKET, s->cid_interrupt, s->report, s->report_len);
+                report_fate(ev->dev, 0, standin_now, s->report, STANDIN_DELIVERED);
+            } else if (s->in_queued == DEVICE_QUEUE) {
+                report_fate(ev->dev, 0, standin_now, s->report, STANDIN_OVERRUN);
+            } else {
+                s->in_queued++;
+                event_t *rx = schedule(transmit(&s->in_busy, standin_now, s->report_len, 0),
+                                       ev->dev, EV_RECEIVED, 0);
+                rx->since = standin_now;
+            }
+            break;
+
+        case EV_RECEIVED:
+            s->in_queued--;
+            deliver(L2CAP_DATA_PACKET, s->cid_interrupt, s->report, s->report_len);
+            report_fate(ev->dev, 0, ev->since, s->report, STANDIN_DELIVERED);
+            break;
+
+        case EV_SENT:
+            report_fate(ev->dev, 1, ev->since, ev->data, ev->arg);
+            // the ACL buffer it used is free again, whether it got
+            // through or was flushed
+            packet[0] = L2CAP_EVENT_CREDITS;
+            packet[1] = 3;
+            bt_store_16(packet, 2, s->cid_interrupt);
+            packet[4] = 1;
+            deliver(HCI_EVENT_PACKET, 0, packet, 5);
+            break;
+
+        case EV_DISCONNECT:
+            s->connected = 0;
+            s->gen++;
+            packet[0] = HCI_EVENT_DISCONNECTION_COMPLETE;
+            packet[1] = 4;
+            bt_store_16(packet, 3, handle);
+            packet[5] = 0x13;
+            deliver(HCI_EVENT_PACKET, 0, packet, 6);
+            break;
+    }
+
+    if (s && standin_event_hook)
+        standin_event_hook(ev->dev);
+}
+
+static timer_source_t * next_timer(void) {
+    timer_source_t *next = NULL;
+    linked_list_iterator_t it;
+    linked_list_iterator_init(&it, &timers);
+    while (linked_list_iterator_has_next(&it)) {
+        timer_source_t *ts = (timer_source_t *)linked_list_iterator_next(&it);
+        if (!next || timercmp(&ts->timeout, &next->timeout, <))
+            next = ts;
+    }
+    return next;
+}
+static uint64_t timer_due(timer_source_t *ts) {
+    return (uint64_t)ts->timeout.tv_sec * 1000000 + ts->timeout.tv_usec;
+}
+
+void standin_run(uint64_t until) {
+    for (;;) {
+        timer_source_t *ts = next_timer();
+        uint64_t t = until + 1;
+        if (nevents)
+            t = events[0].t;
+        if (ts && timer_due(ts) < t)
+            t = timer_due(ts);
+        if (t > until)
+            break;
+        if (t > standin_now)
+            standin_now = t;
+
+        if (ts && timer_due(ts) == t) {
+            linked_list_remove(&timers, (linked_item_t *)ts);
+            ts->process(ts);
+            continue;
+        }
+        event_t ev = pop();
+        run_event(&ev);
+    }
+    standin_now = until;
+}
+// }}}
+
+// the BTstack client calls tinyhidd makes {{{
+int bt_open(void) {
+    return 0;
+}
+int bt_close(void) {
+    return 0;
+}
+btstack_packet_handler_t bt_register_packet_handler(btstack_packet_handler_t h) {
+    btstack_packet_handler_t old = handler;
+    handler = h;
+    return old;
+}
+
+// daemon commands: L2CAP and SDP
+int bt_send_cmd(const hci_cmd_t *cmd, ...) {
+    va_list ap;
+    int n;
+    va_start(ap, cmd);
+
+    if (cmd == &l2cap_register_service) {
+        uint16_t psm = va_arg(ap, int);
+        uint16_t mtu = va_arg(ap, int);
+        if (psm == PSM_HID_INTERRUPT)
+            service_mtu = mtu;
+        goto out;
+    }
+
+    if (cmd == &l2cap_accept_connection) {
+        uint16_t cid = va_arg(ap, int);
+        if ((n = sdev_for_cid(cid)) >= 0)
+            schedule(standin_now + L2CAP_US, n, EV_OPENED,
+                     cid == sdevs[n].cid_control ? PSM_HID_CONTROL : PSM_HID_INTERRUPT);
+        goto out;
+    }
+
+    if (cmd == &l2cap_decline_connection) {
+        uint16_t cid = va_arg(ap, int);
+        // the device gives up on us
+        if ((n = sdev_for_cid(cid)) >= 0)
+            schedule(standin_now + ACL_US, n, EV_DISCONNECT, 0);
+        goto out;
+    }
+
+    if (cmd == &sdp_client_query_services) {
+        uint8_t *addr = va_arg(ap, uint8_t *);
+        va_arg(ap, uint8_t *);
+        uint8_t *atts = va_arg(ap, uint8_t *);
+        uint8_t *range = atts + de_get_header_size(atts);
+        uint32_t first = READ_NET_32(range, de_get_header_size(range)) >> 16;
+        n = sdev_for_addr(addr);
+        schedule(standin_now + SDP_US, n, EV_SDP, first);
+        goto out;
+    }
+
+out:
+    va_end(ap);
+    return 0;
+}
+
+// HCI commands, from hcicmd.c
+int bt_send_packet(uint8_t type, uint16_t channel, uint8_t *data, uint16_t len) {
+    if (type != HCI_COMMAND_DATA_PACKET || len < 3)
+        return 0;
+    uint16_t opcode = READ_BT_16(data, 0);
+    int ogf = opcode >> 10, ocf = opcode & 0x3FF, n = -1;
+    bd_addr_t addr;
+
+    if (opcode == hci_remote_name_request.opcode) {
+        bt_flip_addr(addr, &data[3]);
+        n = sdev_for_addr(addr);
+        schedule(standin_now + CMD_US, -1, EV_CMD_STATUS, opcode);
+        if (n >= 0)
+            schedule(standin_now + NAME_US, n, EV_NAME, 0);
+        return 0;
+    }
+    if (opcode == hci_link_key_request_reply.opcode) {
+        bt_flip_addr(addr, &data[3]);
+        n = sdev_for_addr(addr);
+        schedule_complete(opcode, data);
+        if (n >= 0)
+            schedule(standin_now + AUTH_US, n, EV_INCOMING, PSM_HID_CONTROL);
+        return 0;
+    }
+    if (opcode == OPCODE(OGF_CONTROLLER_BASEBAND, 0x28)) {  // write automatic flush timeout
+        if ((n = sdev_for_handle(READ_BT_16(data, 3))) >= 0)
+            sdevs[n].flush_us = READ_BT_16(data, 5) * SLOT_US;
+        schedule_complete(opcode, data);
+        return 0;
+    }
+    if (opcode == hci_disconnect.opcode) {
+        n = sdev_for_handle(READ_BT_16(data, 3));
+        schedule(standin_now + CMD_US, -1, EV_CMD_STATUS, opcode);
+        if (n >= 0)
+            schedule(standin_now + ACL_US, n, EV_DISCONNECT, 0);
+        return 0;
+    }
+
+    // the rest only need answering: link control and policy commands
+    // with a status, everything else with completion
+    if ((ogf == OGF_LINK_CONTROL && (ocf < 0x0B || ocf > 0x0E)) || ogf == OGF_LINK_POLICY)
+        schedule(standin_now + CMD_US, -1, EV_CMD_STATUS, opcode);
+    else
+        schedule_complete(opcode, data);
+    return 0;
+}
+
+// output reports and HID control requests
+int bt_send_l2cap(uint16_t cid, uint8_t *data, uint16_t len) {
+    int n = sdev_for_cid(cid);
+    if (n < 0 || !sdevs[n].connected)
+        return 1;
+    if (cid == sdevs[n].cid_control) {
+        if ((data[0] & 0xF0) == 0x70)   // SET_PROTOCOL
+            schedule(standin_now + HANDSHAKE_US, n, EV_HANDSHAKE, 0);
+        return 0;
+    }
+    uint64_t done = standin_now + OUT_US;
+    int fate = STANDIN_DELIVERED;
+    if (standin_radio) {
+        done = transmit(&sdevs[n].out_busy, standin_now, len, sdevs[n].flush_us);
+        if (!done) {
+            done = sdevs[n].out_busy;
+            fate = STANDIN_FLUSHED;
+        }
+    }
+    event_t *ev = schedule(done, n, EV_SENT, fate);
+    ev->since = standin_now;
+    memcpy(ev->data, data, len < sizeof(ev->data) ? len : sizeof(ev->data));
+    return 0;
+}
+// }}}
+
+// run loop, on virtual time {{{
+void run_loop_init(RUN_LOOP_TYPE type) {
+}
+void run_loop_add_data_source(data_source_t *ds) {
+}
+int run_loop_remove_data_source(data_source_t *ds) {
+    return 0;
+}
+void run_loop_set_timer(timer_source_t *ts, uint32_t timeout_in_ms) {
+    uint64_t due = standin_now + (uint64_t)timeout_in_ms * 1000;
+    ts->timeout.tv_sec = due / 1000000;
+    ts->timeout.tv_usec = due % 1000000;
+}
+void run_loop_add_timer(timer_source_t *ts) {
+    linked_list_remove(&timers, (linked_item_t *)ts);
+    linked_list_add(&timers, (linked_item_t *)ts);
+}
+int run_loop_remove_timer(timer_source_t *ts) {
+    return linked_list_remove(&timers, (linked_item_t *)ts);
+}
+void run_loop_execute(void) {
+    while (nevents || timers)
+        standin_run(standin_now + 1000000);
+}
+// }}}
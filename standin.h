@@ -0,0 +1,42 @@
+// a stand-in for the BTstack daemon, the controller behind it and the run
+// loop, for benchmarking tinyhidd without hardware. it takes the place of
+// the BTstack client calls (bt_send_cmd and friends) and run_loop_*,
+// answers what tinyhidd sends after modelled delays on a virtual clock, and
+// passes the resulting events to the registered packet handler.
+//
+// remote devices are numbered from 0, and connect to us as a paired HID
+// device would.
+
+// virtual time in us
+extern uint64_t standin_now;
+
+// called after each event for device n has been handled
+extern void (*standin_event_hook)(int n);
+
+// what became of a report
+#define STANDIN_DELIVERED   0
+#define STANDIN_FLUSHED     1   // output: our flush timeout ran out
+#define STANDIN_OVERRUN     2   // input: the device's controller was full
+#define STANDIN_TOO_LONG    3   // input: longer than the channel MTU
+
+// called once the fate of each report is known. out is 0 for the device's
+// reports, 1 for ours. sent is when it was sent, data its first 8 bytes
+extern void (*standin_report_hook)(int n, int out, uint64_t sent, uint8_t *data, int fate);
+
+// model the radio link: time on air, retransmission of the lost
+// standin_loss_pct of baseband packets, and our flush timeout. otherwise
+// reports arrive the moment they are sent
+extern int standin_radio;
+extern int standin_loss_pct;
+
+void standin_init(int ndevs);
+void standin_addr(int n, bd_addr_t addr);
+
+// schedule device n connecting, or dropping its link, at virtual time t
+void standin_connect(int n, uint64_t t, uint32_t cod);
+void standin_disconnect(int n, uint64_t t);
+// device n sends count copies of report, period us apart, starting at t
+void standin_stream(int n, uint64_t t, uint32_t period, int count, uint8_t *report, int len);
+
+// handle events and timers due up to time until
+void standin_run(uint64_t until);
@@ -4,11 +4,15 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <btstack/btstack.h>
 #include <btstack/utils.h>
 #include <btstack/hci_cmds.h>
 #include <btstack/linked_list.h>
 #include "hiddevs.h"
+#include "ctl.h"
+#include "hcicmd.h"
 
 // inquiry period (in BT time units of 1.28s)
 #define INTERVAL 5
@@ -91,6 +95,7 @@ void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint
     bd_addr_t addr;
     if (packet_type != HCI_EVENT_PACKET)
         return;
+    hcicmd_event(packet, size);
 
     switch (packet[0]) {
         case BTSTACK_EVENT_STATE:
@@ -99,7 +104,7 @@ void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint
             if (have_remote) {
                 start_pairing();
             } else {
-                bt_send_cmd(&hci_inquiry, HCI_INQUIRY_LAP, INTERVAL, 0);
+                hcicmd_send(HCICMD_BACKGROUND, &hci_inquiry, HCI_INQUIRY_LAP, INTERVAL, 0);
                 printf("Scanning...\n");
             }
             break;
@@ -125,13 +130,13 @@ void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint
             have_remote = 1;
             BD_ADDR_COPY(remote, addr);
             printf("\n");
-            bt_send_cmd(&hci_inquiry_cancel);
+            hcicmd_send(HCICMD_URGENT, &hci_inquiry_cancel);
             break;
         
         case HCI_EVENT_INQUIRY_COMPLETE:
             // keep scanning!
             if (!have_remote)
-                bt_send_cmd(&hci_inquiry, HCI_INQUIRY_LAP, INTERVAL, 0);
+                hcicmd_send(HCICMD_BACKGROUND, &hci_inquiry, HCI_INQUIRY_LAP, INTERVAL, 0);
             break;
 
         case HCI_EVENT_COMMAND_COMPLETE:
@@ -141,13 +146,13 @@ void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint
 
         case HCI_EVENT_PIN_CODE_REQUEST:
             BREAK_UNLESS_REMOTE(packet, 2);
-            bt_send_cmd(&hci_pin_code_request_reply, &remote, strlen(pin), pin);
+            hcicmd_send(HCICMD_URGENT, &hci_pin_code_request_reply, &remote, strlen(pin), pin);
             break;
 
         case HCI_EVENT_LINK_KEY_REQUEST:
             BREAK_UNLESS_REMOTE(packet, 2);
             printf("If using a keyboard, enter the PIN on the device now.\n");
-            bt_send_cmd(&hci_link_key_request_negative_reply, &remote);
+            hcicmd_send(HCICMD_URGENT, &hci_link_key_request_negative_reply, &remote);
             break;
 
         case HCI_EVENT_LINK_KEY_NOTIFICATION:
@@ -168,7 +173,7 @@ void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint
                 if (!paired)
                     start_pairing();
                 else
-                    bt_send_cmd(&hci_create_connection, &remote, 0x0000, 0, 0, 0, 0);  // XXX we have no way to find valid packet types
+                    hcicmd_send(HCICMD_NORMAL, &hci_create_connection, &remote, 0x0000, 0, 0, 0, 0);  // XXX we have no way to find valid packet types
             } else {
                 remote_handle = READ_BT_16(packet, 3);
             }
@@ -192,7 +197,7 @@ void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint
             if (packet[2]) {
                 printf("Failed to pair (status 0x%02X). Check the PIN - many devices use 0000 or 1234\n", packet[2]);
                 if (remote_handle)
-                    bt_send_cmd(&hci_disconnect, remote_handle, 0x13);
+                    hcicmd_send(HCICMD_URGENT, &hci_disconnect, remote_handle, 0x13);
                 exit(1);
             } else {
                 printf("Pairing succeeded!\n");
@@ -200,39 +205,64 @@ void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint
                 
                 // disconnect/reconnect so tinyhidd picks it up, if it's
                 // running
-                bt_send_cmd(&hci_disconnect, remote_handle, 0x13);
+                hcicmd_send(HCICMD_URGENT, &hci_disconnect, remote_handle, 0x13);
             }
             break;
 
         case HCI_EVENT_DISCONNECTION_COMPLETE:
             if (remote_handle == READ_BT_16(packet, 3) &&
                 paired) {
-                bt_send_cmd(&hci_create_connection, &remote, 0x0000, 0, 0, 0, 0);  // XXX we have no way to find valid packet types
+                hcicmd_send(HCICMD_NORMAL, &hci_create_connection, &remote, 0x0000, 0, 0, 0, 0);  // XXX we have no way to find valid packet types
                 printf("Disconnection complete... reconnecting\n");
             }
             break;
     }
 }
 
+// hand the pairing to a running tinyhidd, so the device is picked up on the
+// same connection
+static int pair_in_daemon(void) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, CTL_SOCKET, sizeof(sa.sun_path) - 1);
+
+    char cmd[64];
+    int len = snprintf(cmd, sizeof(cmd), "pair %s %s\n", bd_addr_to_str(remote), pin);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0 ||
+        sendto(fd, cmd, len, 0, (struct sockaddr *)&sa, sizeof(sa)) < len) {
+        printf("Couldn't contact tinyhidd on " CTL_SOCKET "\n");
+        return 1;
+    }
+    close(fd);
+    printf("Pairing request sent to tinyhidd; see its output for progress\n");
+    return 0;
+}
+
 void usage(void) {
-    printf("Usage: tinyhidd-pair [-a 00:22:44:66:88:aa] [-p 1234]\n"
+    printf("Usage: tinyhidd-pair [-a 00:22:44:66:88:aa] [-p 1234] [-d]\n"
            "\n"
            "    Pair with a HID device. If no address is specified, the first\n"
            "    discoverable HID device that is found is used.\n"
            "    A PIN will be automatically generated if not specified.\n"
+           "    With -d, ask a running tinyhidd to pair with the device given\n"
+           "    by -a instead.\n"
           );
     exit(1);
 }
 
 int main(int argc, char **argv){
-    run_loop_init(RUN_LOOP_POSIX);
-    int err = bt_open();
-    if (err)
-        return err;
+    int daemon = 0;
 
     int c;
-    while ((c = getopt(argc, argv, "a:p:")) != -1) {
+    while ((c = getopt(argc, argv, "a:p:d")) != -1) {
         switch (c) {
+            case 'd':
+                daemon = 1;
+                break;
+
             case 'a':
                 // sscan_bd_addr is a bit permissive
                 if (sscan_bd_addr(optarg, remote) &&
@@ -262,6 +292,17 @@ int main(int argc, char **argv){
         pin = generate_pin();
     printf("Using PIN: %s\n", pin);
 
+    if (daemon) {
+        if (!have_remote)
+            usage();
+        return pair_in_daemon();
+    }
+
+    run_loop_init(RUN_LOOP_POSIX);
+    int err = bt_open();
+    if (err)
+        return err;
+
     bt_register_packet_handler(packet_handler);
 	bt_send_cmd(&btstack_set_power_mode, HCI_POWER_ON);
     run_loop_execute();	
@@ -1,20 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <btstack/btstack.h>
 #include <btstack/run_loop.h>
 #include <btstack/hci_cmds.h>
 #include "bthid.h"
+#include "capture.h"
+#include "uhid.h"
+#include "linkstats.h"
+#include "ctl.h"
+#include "hiddevs.h"
+#include "handoff.h"
+#include "hcicmd.h"
+
+#define DEFAULT_MTU 250
+
+void usage(void) {
+    printf("Usage: tinyhidd [-b] [-s] [-c capture [-d 00:22:44:66:88:aa]...]\n"
+           "       tinyhidd -r capture [-f] [-u sink] [-n copies]\n"
+           "\n"
+           "    -b  start keyboards and mice in boot protocol while connecting\n"
+           "    -s  print report counters and link telemetry for each device\n"
+           "    -c  record HID traffic to the capture file\n"
+           "    -d  only record this device (may be repeated)\n"
+           "    -r  replay a capture file instead of connecting to BTstack\n"
+           "    -f  replay as fast as possible rather than at original timing\n"
+           "    -u  uhid device to replay into (default /dev/null)\n"
+           "    -n  replay each device as this many virtual devices\n"
+          );
+    exit(1);
+}
 
 int main(int argc, char **argv){
+    const char *capture = NULL, *replay = NULL;
+    int realtime = 1, copies = 1, handoff_fd = -1;
+    bd_addr_t addr;
+
+    int c;
+    while ((c = getopt(argc, argv, "bsc:d:r:fu:n:H:")) != -1) {
+        switch (c) {
+            case 'b':
+                bthid_boot_protocol = 1;
+                break;
+
+            case 's':
+                linkstats_verbose = 1;
+                break;
+
+            case 'c':
+                capture = optarg;
+                break;
+
+            case 'd':
+                if (!sscan_bd_addr((uint8_t *)optarg, addr) ||
+                    strlen(optarg) != 17)
+                    usage();
+                capture_select(addr);
+                break;
+
+            case 'r':
+                replay = optarg;
+                uhid_path = "/dev/null";
+                break;
+
+            case 'f':
+                realtime = 0;
+                break;
+
+            case 'u':
+                uhid_path = optarg;
+                break;
+
+            case 'n':
+                copies = atoi(optarg);
+                if (copies < 1)
+                    usage();
+                break;
+
+            case 'H':   // internal: restarted, state arrives on this fd
+                handoff_fd = atoi(optarg);
+                break;
+
+            default:
+                usage();
+        }
+    }
+
+    if (optind < argc)
+        usage();
+
     run_loop_init(RUN_LOOP_POSIX);
+    remap_load();
+
+    if (replay)
+        return replay_run(replay, realtime, copies);
+
+    handoff_init(argc, argv);
+    // on failure, exit without destroying the devices the old process still has
+    if (handoff_fd >= 0 && handoff_receive(handoff_fd))
+        return 1;
+
+    // after the handoff, so the old process has finished with the file
+    if (capture && capture_open(capture, handoff_fd >= 0))
+        return 1;
+
     int err = bt_open();
     if (err)
         return err;
 
+    ctl_open();
+
     bt_register_packet_handler(bthid_packet_handler);
+    hcicmd_register_failure_handler(bthid_command_failed);
     bt_send_cmd(&btstack_set_power_mode, HCI_POWER_ON);
-    bt_send_cmd(&l2cap_register_service, PSM_HID_CONTROL, 250);
-    bt_send_cmd(&l2cap_register_service, PSM_HID_INTERRUPT, 250);
+    // incoming channels get the service MTU, so make it big enough for all
+    int mtu = hiddevs_max_mtu();
+    if (mtu < DEFAULT_MTU)
+        mtu = DEFAULT_MTU;
+    bt_send_cmd(&l2cap_register_service, PSM_HID_CONTROL, mtu);
+    bt_send_cmd(&l2cap_register_service, PSM_HID_INTERRUPT, mtu);
     run_loop_execute();
 
     return 0;
 }
-
@@ -6,6 +6,8 @@
 #include "bthid.h"
 #include "uhid.h"
 
+const char *uhid_path = "/dev/uhid";
+
 static int uhid_write(int fd, const struct uhid_event *ev) {
     ssize_t ret;
 
@@ -18,73 +20,128 @@ static int process(data_source_t *ds) {
     ssize_t ret;
     ret = read(ds->fd, &ev, sizeof(ev));
     if (ret != sizeof(ev))
-        return;
+        return 0;
 
-    if (ev.type == UHID_OUTPUT) {
-        bthid_dev_t *dev = bthid_dev_for_ds(ds);
-        bthid_report_out(dev, ev.u.output.data, ev.u.output.size);
+    bthid_dev_t *dev = bthid_dev_for_ds(ds);
+    switch (ev.type) {
+        case UHID_OUTPUT:
+            bthid_report_out(dev, ev.u.output.data, ev.u.output.size);
+            break;
+        case UHID_START:
+            dev->uhid_started = 1;
+            break;
+        case UHID_STOP:
+            dev->uhid_started = 0;
+            break;
+        case UHID_OPEN:
+            bthid_set_open(dev, 1);
+            break;
+        case UHID_CLOSE:
+            bthid_set_open(dev, 0);
+            break;
     }
+    return 0;
 }
 
-static int create(int fd, bthid_dev_t *dev) {
+static int create(int fd, bthid_dev_t *dev, uint8_t *descriptor, int descriptor_len) {
     struct uhid_event ev;
     memset(&ev, 0, sizeof(ev));
     ev.type = UHID_CREATE;
 
-    strncpy((char*)ev.u.create.name, dev->name, sizeof(ev.u.create.name));
+    // boot devices may not have a name yet
+    if (dev->name)
+        snprintf((char*)ev.u.create.name, sizeof(ev.u.create.name), "%s", dev->name);
+    else
+        snprintf((char*)ev.u.create.name, sizeof(ev.u.create.name), "Bluetooth HID %s", bd_addr_to_str(dev->addr));
     ev.u.create.vendor = dev->vendor_id;
     ev.u.create.product = dev->product_id;
     ev.u.create.version = dev->version;
 
-    ev.u.create.rd_data = dev->descriptor;
-    ev.u.create.rd_size = dev->descriptor_len;
+    ev.u.create.rd_data = descriptor;
+    ev.u.create.rd_size = descriptor_len;
     ev.u.create.bus = BUS_BLUETOOTH;
 
     snprintf((char*)ev.u.create.phys, sizeof(ev.u.create.phys), "tinyhidd-%s", bd_addr_to_str(dev->addr));
-    strncpy((char*)ev.u.create.uniq, bd_addr_to_str(dev->addr), sizeof(ev.u.create.uniq));
+    snprintf((char*)ev.u.create.uniq, sizeof(ev.u.create.uniq), "%s", bd_addr_to_str(dev->addr));
     return uhid_write(fd, &ev);
 }
 
-void uhid_register(bthid_dev_t *dev) {
+static void do_register(bthid_dev_t *dev, uint8_t *descriptor, int descriptor_len) {
     if (dev->ds) {
         printf("ERROR: Tried to register device more than once\n");
         return;
     }
-    int fd = open("/dev/uhid", O_RDWR);
+    // not inherited on restart; the new process is sent the fds it needs
+    int fd = open(uhid_path, O_RDWR | O_CLOEXEC);
     if (fd < 0) {
-        printf("ERROR: Cannot open /dev/uhid!\n");
+        printf("ERROR: Cannot open %s!\n", uhid_path);
         exit(1);
     }
-    int ret = create(fd, dev);
+    int ret = create(fd, dev, descriptor, descriptor_len);
     if (ret) {
         close(fd);
         printf("ERROR: Cannot create UHID device!\n");
         return;
     }
 
-    dev->ds = malloc(sizeof(data_source_t));
+    uhid_adopt(dev, fd);
+}
+
+// take on an fd with a device already created on it
+void uhid_adopt(bthid_dev_t *dev, int fd) {
+    dev->ds = &dev->ds_buf;
     dev->ds->fd = fd;
     dev->ds->process = process;
     run_loop_add_data_source(dev->ds);
 }
 
+void uhid_register(bthid_dev_t *dev) {
+    do_register(dev, dev->descriptor, dev->descriptor_len);
+}
+
+// register with a stand-in descriptor, before the real one is known
+void uhid_register_boot(bthid_dev_t *dev, uint8_t *descriptor, int descriptor_len) {
+    do_register(dev, descriptor, descriptor_len);
+}
+
+// replace the device with one using the full attributes, on the same fd
+void uhid_recreate(bthid_dev_t *dev) {
+    if (!dev->ds)
+        return;
+
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_DESTROY;
+    if (uhid_write(dev->ds->fd, &ev) ||
+        create(dev->ds->fd, dev, dev->descriptor, dev->descriptor_len)) {
+        printf("ERROR: Cannot recreate UHID device!\n");
+        uhid_unregister(dev);
+    }
+}
+
 void uhid_unregister(bthid_dev_t *dev) {
     if (!dev->ds)
         return;
     run_loop_remove_data_source(dev->ds);
     // auto-destroy
     close(dev->ds->fd);
-    free(dev->ds);
+    dev->ds = NULL;
 }
 
-void uhid_report_in(bthid_dev_t *dev, uint8_t *report, int size) {
-    if (!dev->ds)
-        return;
-
+int uhid_report_in(bthid_dev_t *dev, uint8_t *report, int size) {
     struct uhid_event ev;
+    if (!dev->ds || !dev->uhid_open)
+        return 0;
+    if (size > sizeof(ev.u.input.data)) {
+        printf("WARNING: report from %s too long (%d bytes), dropping\n", bd_addr_to_str(dev->addr), size);
+        return 0;
+    }
+
     memset(&ev, 0, sizeof(ev));
     ev.type = UHID_INPUT;
     ev.u.input.size = size;
     memcpy(ev.u.input.data, report, size);
-    uhid_write(dev->ds->fd, &ev);
+    if (dev->remap)
+        remap_report(dev->remap, ev.u.input.data, size);
+    return !uhid_write(dev->ds->fd, &ev);
 }
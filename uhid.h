@@ -1,3 +1,10 @@
+// device node to create devices on. replay points this at a fake sink
+extern const char *uhid_path;
+
 void uhid_register(bthid_dev_t *dev);
+void uhid_register_boot(bthid_dev_t *dev, uint8_t *descriptor, int descriptor_len);
+void uhid_recreate(bthid_dev_t *dev);
+void uhid_adopt(bthid_dev_t *dev, int fd);
 void uhid_unregister(bthid_dev_t *dev);
-void uhid_report_in(bthid_dev_t *dev, uint8_t *report, int size);
+// returns nonzero if the report was passed on
+int uhid_report_in(bthid_dev_t *dev, uint8_t *report, int size);